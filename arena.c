@@ -0,0 +1,172 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Virtual arena every superblock and page span is carved from.
+ *
+ * ARENA_SIZE bytes of address space are reserved once with
+ * mmap(PROT_NONE), so nothing else (sbrk, other mmaps) can land in the
+ * middle of the heap. The low half holds superblocks, the high half the
+ * spans of the page heap (span.c), so a block is a small one iff it falls
+ * in [sb_region_lo, sb_region_hi), and a span iff it falls in
+ * [span_region_lo, span_region_hi). Both halves grow upwards by atomic
+ * bumps. The superblock half is handed out in ARENA_CHUNK_SIZE chunks; each
+ * CPU heap then carves superblocks out of its current chunk with a CAS
+ * on its own cursor. Pages of a chunk are committed (made read/write)
+ * when the chunk is taken, so the refill path makes one mprotect call per
+ * chunk and none per superblock.
+ *
+ * SPEEDYLOC_THP=1 backs the arena with transparent huge pages: chunks and
+ * span growth become HUGE_PAGE_SIZE aligned and long, and are advised
+ * MADV_HUGEPAGE, so the superblocks of a CPU are packed into huge pages.
+ * SPEEDYLOC_THP=hugetlb maps them MAP_HUGETLB instead, falling back to
+ * transparent huge pages once the reserved pool runs dry.
+ */
+
+void *sb_region_lo = NULL;  // [lo, hi) holds every superblock
+void *sb_region_hi = NULL;
+void *span_region_lo = NULL;  // [lo, hi) holds every span
+void *span_region_hi = NULL;
+static char *arena_next = NULL;  // first chunk never handed out
+static char *span_next = NULL;   // first span page never handed out
+int arena_thp = THP_OFF;
+size_t arena_committed = 0;  // bytes made read/write so far
+size_t arena_chunk_size = ARENA_CHUNK_SIZE;
+
+/*
+ * read the huge page mode; hugetlb only if a huge page can be mapped
+ */
+static void initialize_thp()
+{
+    char *thp = getenv("SPEEDYLOC_THP");
+    if (thp == NULL || strcmp(thp, "0") == 0) return;
+    arena_thp = THP_MADVISE;
+    arena_chunk_size = HUGE_PAGE_SIZE;
+    if (strcmp(thp, "hugetlb") != 0) return;
+    void *probe = mmap(NULL, HUGE_PAGE_SIZE, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+    if (probe == MAP_FAILED) return;
+    munmap(probe, HUGE_PAGE_SIZE);
+    arena_thp = THP_HUGETLB;
+}
+
+/*
+ * reserve the arena, HUGE_PAGE_SIZE aligned; retries with half the
+ * size when the address space is too small for ARENA_SIZE
+ */
+int initialize_arena()
+{
+    initialize_thp();
+    size_t size;
+    for (size = ARENA_SIZE; size >= 2 * arena_chunk_size; size >>= 1) {
+        size_t slack = HUGE_PAGE_SIZE;
+        char *raw = mmap(NULL, size + slack, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+        if (raw == MAP_FAILED) continue;
+        char *lo = (char *)(((uintptr_t)raw + slack - 1) & ~(slack - 1));
+        // trim the alignment slack on both ends
+        if (lo != raw) munmap(raw, lo - raw);
+        if (lo + size != raw + size + slack)
+            munmap(lo + size, raw + size + slack - (lo + size));
+        sb_region_lo = lo;
+        sb_region_hi = lo + size / 2;
+        span_region_lo = lo + size / 2;
+        span_region_hi = lo + size;
+        arena_next = lo;
+        span_next = span_region_lo;
+        return SUCCESS;
+    }
+    return FAILURE;
+}
+
+/*
+ * make $len reserved bytes at $region read/write, backed by huge pages
+ * in huge page mode
+ */
+static int arena_commit(char *region, size_t len)
+{
+    int flags = MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED;
+    if (arena_thp == THP_HUGETLB) {
+        if (mmap(region, len, PROT_READ | PROT_WRITE, flags | MAP_HUGETLB,
+                 -1, 0) != MAP_FAILED) {
+            __atomic_fetch_add(&arena_committed, len, __ATOMIC_RELAXED);
+            return SUCCESS;
+        }
+        // the pool ran dry: transparent huge pages from now on
+        arena_thp = THP_MADVISE;
+    }
+    // a failed MAP_HUGETLB may have left a hole in the reservation
+    if (mprotect(region, len, PROT_READ | PROT_WRITE) != 0 &&
+        mmap(region, len, PROT_READ | PROT_WRITE, flags, -1, 0) == MAP_FAILED)
+        return FAILURE;
+    if (arena_thp != THP_OFF) madvise(region, len, MADV_HUGEPAGE);
+    __atomic_fetch_add(&arena_committed, len, __ATOMIC_RELAXED);
+    return SUCCESS;
+}
+
+/*
+ * take a fresh chunk off the arena and commit its pages;
+ * returns NULL once the arena is used up
+ */
+static char *arena_take_chunk()
+{
+    char *chunk =
+        __atomic_fetch_add(&arena_next, arena_chunk_size, __ATOMIC_RELAXED);
+    if (chunk + arena_chunk_size > (char *)sb_region_hi) return NULL;
+    if (arena_commit(chunk, arena_chunk_size) != SUCCESS) return NULL;
+    return chunk;
+}
+
+/*
+ * carve one SB_SIZE aligned superblock region for $cpu's heap out of its
+ * current chunk, taking a new chunk when it is used up;
+ * returns NULL if the arena is exhausted
+ */
+void *arena_alloc_superblock(int cpu)
+{
+    if (cpu < 0 || cpu >= sys_core_count) cpu = 0;
+    char **cursor = &cpu_heaps[cpu].chunk;
+    char *sb = __atomic_load_n(cursor, __ATOMIC_ACQUIRE);
+    for (;;) {
+        // a cursor on a chunk boundary means the chunk is used up
+        if (sb == NULL || ((uintptr_t)sb & (arena_chunk_size - 1)) == 0) {
+            char *chunk = arena_take_chunk();
+            if (chunk == NULL) return NULL;
+            // if another size class of this CPU took a chunk meanwhile,
+            // its cursor wins and the rest of ours is never touched
+            // (committed, but costs no memory until written)
+            __atomic_compare_exchange_n(cursor, &sb, chunk + SB_SIZE, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE);
+            return chunk;
+        }
+        if (__atomic_compare_exchange_n(cursor, &sb, sb + SB_SIZE, true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            return sb;
+    }
+}
+
+/*
+ * take at least *$len fresh bytes off the span half and commit them,
+ * whole huge pages in huge page mode; *$len is set to what was taken;
+ * returns NULL once the arena is used up
+ */
+void *arena_grow_spans(size_t *len)
+{
+    if (arena_thp != THP_OFF)
+        *len = (*len + HUGE_PAGE_SIZE - 1) & ~(HUGE_PAGE_SIZE - 1);
+    char *region = __atomic_fetch_add(&span_next, *len, __ATOMIC_RELAXED);
+    if (region + *len > (char *)span_region_hi) return NULL;
+    if (arena_commit(region, *len) != SUCCESS) return NULL;
+    return region;
+}
@@ -0,0 +1,63 @@
+/*
+ * Hoard's cache-scratch, for passive false sharing: the main thread
+ * allocates one small object per thread, so that they likely share cache
+ * lines, and hands them out. Every thread frees the object it was given,
+ * then runs the cache-thrash loop. An allocator that serves the thread's
+ * next malloc from the object it just freed, while that object still sits
+ * on a line other threads write to, makes the writes bounce the line.
+ *
+ *   usage: cache_scratch <lib> <threads>
+ *   prints lib,bench,threads,seconds,ops_per_sec
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ITERATIONS 20000  // per thread
+#define REPETITIONS 1000  // writes per object
+#define OBJECT_SIZE 8
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+    int i, r, k;
+    free(arg);  // a remote free of the main thread's object
+    for (i = 0; i < ITERATIONS; i++) {
+        volatile char *obj = malloc(OBJECT_SIZE);
+        for (r = 0; r < REPETITIONS; r++)
+            for (k = 0; k < OBJECT_SIZE; k++) obj[k]++;
+        free((void *)obj);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = argc > 1 ? argv[1] : "default";
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    int i;
+    if (threads < 1) threads = 1;
+
+    pthread_t *ids = malloc(threads * sizeof(*ids));
+    char **objs = malloc(threads * sizeof(*objs));
+    for (i = 0; i < threads; i++) objs[i] = malloc(OBJECT_SIZE);
+
+    double start = now_ns();
+    for (i = 0; i < threads; i++)
+        pthread_create(&ids[i], NULL, worker, objs[i]);
+    for (i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%s,cache-scratch,%d,%.2f,%.0f\n", lib, threads, elapsed,
+           (double)ITERATIONS * threads / elapsed);
+    free(objs);
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,58 @@
+/*
+ * Hoard's cache-thrash, for active false sharing: every thread
+ * repeatedly allocates a small object, writes to it REPETITIONS times and
+ * frees it. If the allocator hands objects on the same cache line to
+ * different threads, the writes bounce that line between the CPUs and
+ * the time grows with the thread count instead of staying flat.
+ *
+ *   usage: cache_thrash <lib> <threads>
+ *   prints lib,bench,threads,seconds,ops_per_sec
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ITERATIONS 20000  // per thread
+#define REPETITIONS 1000  // writes per object
+#define OBJECT_SIZE 8
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+    int i, r, k;
+    (void)arg;
+    for (i = 0; i < ITERATIONS; i++) {
+        volatile char *obj = malloc(OBJECT_SIZE);
+        for (r = 0; r < REPETITIONS; r++)
+            for (k = 0; k < OBJECT_SIZE; k++) obj[k]++;
+        free((void *)obj);
+    }
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = argc > 1 ? argv[1] : "default";
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    int i;
+    if (threads < 1) threads = 1;
+
+    pthread_t *ids = malloc(threads * sizeof(*ids));
+    double start = now_ns();
+    for (i = 0; i < threads; i++) pthread_create(&ids[i], NULL, worker, NULL);
+    for (i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // one malloc/write/free round per iteration
+    printf("%s,cache-thrash,%d,%.2f,%.0f\n", lib, threads, elapsed,
+           (double)ITERATIONS * threads / elapsed);
+    free(ids);
+    return 0;
+}
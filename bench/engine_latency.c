@@ -0,0 +1,96 @@
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define ROUNDS 1000000
+#define BURST 512
+#define NUM_THREADS 4
+
+static const size_t sizes[] = {16, 64, 256, 1000, 4000};
+#define NUM_SIZES (sizeof(sizes) / sizeof(sizes[0]))
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * malloc immediately followed by free: both hit the fast path
+ * of the same superblock every time
+ */
+double pair_latency(size_t size)
+{
+    long i;
+    double start = now_ns();
+    for (i = 0; i < ROUNDS; i++) {
+        void *p = malloc(size);
+        *(volatile char *)p = 1;
+        free(p);
+    }
+    return (now_ns() - start) / (2.0 * ROUNDS);
+}
+
+/*
+ * BURST mallocs then BURST frees: walks the free list and
+ * regularly falls into the slow path
+ */
+double burst_latency(size_t size)
+{
+    void *ptrs[BURST];
+    long i, j;
+    double start = now_ns();
+    for (i = 0; i < ROUNDS / BURST; i++) {
+        for (j = 0; j < BURST; j++) ptrs[j] = malloc(size);
+        for (j = 0; j < BURST; j++) free(ptrs[j]);
+    }
+    return (now_ns() - start) / (2.0 * (ROUNDS / BURST) * BURST);
+}
+
+void *threaded_pairs(void *arg)
+{
+    double *out = (double *)arg;
+    *out = pair_latency(64);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *engine = argc > 1 ? argv[1] : "default";
+    int i;
+
+    // the library falls back to cas when the asked engine is missing:
+    // such a run would measure cas under another label
+    const char *(*selected)() = dlsym(RTLD_DEFAULT, "speedyloc_engine");
+    if (selected != NULL && argc > 1 && strcmp(selected(), engine) != 0) {
+        fprintf(stderr, "engine_latency: %s asked, %s selected; skipped\n",
+                engine, selected());
+        return 1;
+    }
+
+    printf("engine,pattern,size,threads,ns_per_op\n");
+    for (i = 0; i < NUM_SIZES; i++) {
+        printf("%s,pair,%zu,1,%.2f\n", engine, sizes[i],
+               pair_latency(sizes[i]));
+        printf("%s,burst,%zu,1,%.2f\n", engine, sizes[i],
+               burst_latency(sizes[i]));
+    }
+
+    // threads outnumbering cores force preemption inside the sections
+    pthread_t threads[NUM_THREADS];
+    double lat[NUM_THREADS], sum = 0;
+    for (i = 0; i < NUM_THREADS; i++)
+        pthread_create(&threads[i], NULL, threaded_pairs, &lat[i]);
+    for (i = 0; i < NUM_THREADS; i++) {
+        pthread_join(threads[i], NULL);
+        sum += lat[i];
+    }
+    printf("%s,pair,64,%d,%.2f\n", engine, NUM_THREADS, sum / NUM_THREADS);
+    return 0;
+}
@@ -0,0 +1,119 @@
+/*
+ * Larson & Krishnan's server simulation: every thread owns a slot array
+ * of blocks and keeps replacing a random one with a block of a random
+ * size. After ROUNDS replacements it hands its array over to a new
+ * thread and exits, so that most blocks are freed by another thread than
+ * the one that allocated them, as in a server whose requests outlive the
+ * thread that took them in.
+ *
+ *   usage: larson <lib> <threads> [seconds]
+ *   prints lib,bench,threads,seconds,ops_per_sec
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SLOTS 1000    // blocks per thread
+#define ROUNDS 10000  // replacements before the array changes hands
+#define MIN_SIZE 8
+#define MAX_SIZE 1000
+
+/*
+ * one chain of threads passing a slot array on
+ * @attri slots: the blocks
+ * @attri seed: of its RNG, carried over
+ * @attri ops: malloc/free pairs done by every thread of the chain
+ */
+struct chain {
+    char *slots[SLOTS];
+    unsigned seed;
+    unsigned long long ops;
+};
+
+static volatile int stop = 0;
+static pthread_mutex_t done_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t done_cond = PTHREAD_COND_INITIALIZER;
+static int running;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static size_t draw_size(unsigned *seed)
+{
+    return MIN_SIZE + rand_r(seed) % (MAX_SIZE - MIN_SIZE + 1);
+}
+
+static void *worker(void *arg)
+{
+    struct chain *c = arg;
+    int i;
+    for (i = 0; i < ROUNDS && !stop; i++) {
+        int slot = rand_r(&c->seed) % SLOTS;
+        free(c->slots[slot]);
+        size_t size = draw_size(&c->seed);
+        c->slots[slot] = malloc(size);
+        c->slots[slot][0] = (char)size;
+        c->ops++;
+    }
+
+    // hand the blocks over to a fresh thread
+    pthread_t next;
+    if (!stop && pthread_create(&next, NULL, worker, c) == 0) {
+        pthread_detach(next);
+        return NULL;
+    }
+    pthread_mutex_lock(&done_lock);
+    running--;
+    pthread_cond_signal(&done_cond);
+    pthread_mutex_unlock(&done_lock);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = argc > 1 ? argv[1] : "default";
+    int threads = argc > 2 ? atoi(argv[2]) : 1;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    int i, s;
+    if (threads < 1) threads = 1;
+
+    // the main thread fills every array, the workers free it all
+    struct chain *chains = calloc(threads, sizeof(*chains));
+    for (i = 0; i < threads; i++) {
+        chains[i].seed = i + 1;
+        for (s = 0; s < SLOTS; s++)
+            chains[i].slots[s] = malloc(draw_size(&chains[i].seed));
+    }
+
+    running = threads;
+    double start = now_ns();
+    for (i = 0; i < threads; i++) {
+        pthread_t id;
+        pthread_create(&id, NULL, worker, &chains[i]);
+        pthread_detach(id);
+    }
+    struct timespec ts = {(time_t)seconds,
+                          (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    stop = 1;
+    double elapsed = (now_ns() - start) / 1e9;
+
+    pthread_mutex_lock(&done_lock);
+    while (running > 0) pthread_cond_wait(&done_cond, &done_lock);
+    pthread_mutex_unlock(&done_lock);
+
+    unsigned long long ops = 0;
+    for (i = 0; i < threads; i++) {
+        ops += chains[i].ops;
+        for (s = 0; s < SLOTS; s++) free(chains[i].slots[s]);
+    }
+    printf("%s,larson,%d,%.2f,%.0f\n", lib, threads, elapsed, ops / elapsed);
+    free(chains);
+    return 0;
+}
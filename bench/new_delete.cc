@@ -0,0 +1,84 @@
+#include <cstdio>
+#include <cstdlib>
+#include <ctime>
+#include <new>
+
+#define ROUNDS 200
+#define BURST 4096
+
+template <size_t N>
+struct object {
+    char payload[N];
+};
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+// what libstdc++'s operator new and delete do: forward to malloc/free
+static void *forward_new(size_t size)
+{
+    void *ptr = malloc(size);
+    if (ptr == NULL) throw std::bad_alloc();
+    return ptr;
+}
+
+static void forward_delete(void *ptr) { free(ptr); }
+
+/*
+ * BURST news then BURST sized deletes of object<N>, through whatever
+ * operator new/delete the process binds
+ */
+template <size_t N>
+static double new_delete_latency()
+{
+    static object<N> *ptrs[BURST];
+    long i, j;
+    double start = now_ns();
+    for (i = 0; i < ROUNDS; i++) {
+        for (j = 0; j < BURST; j++) ptrs[j] = new object<N>;
+        asm volatile("" : : "r"(ptrs) : "memory");
+        for (j = 0; j < BURST; j++) delete ptrs[j];
+    }
+    return (now_ns() - start) / (2.0 * ROUNDS * BURST);
+}
+
+/*
+ * the same pattern through the malloc forwarding path
+ */
+template <size_t N>
+static double forward_latency()
+{
+    static void *ptrs[BURST];
+    long i, j;
+    double start = now_ns();
+    for (i = 0; i < ROUNDS; i++) {
+        for (j = 0; j < BURST; j++) ptrs[j] = forward_new(sizeof(object<N>));
+        asm volatile("" : : "r"(ptrs) : "memory");
+        for (j = 0; j < BURST; j++) forward_delete(ptrs[j]);
+    }
+    return (now_ns() - start) / (2.0 * ROUNDS * BURST);
+}
+
+template <size_t N>
+static void report(const char *lib)
+{
+    printf("%s,new_delete,%zu,%.2f\n", lib, N, new_delete_latency<N>());
+    printf("%s,forward,%zu,%.2f\n", lib, N, forward_latency<N>());
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = argc > 1 ? argv[1] : "default";
+    printf("lib,path,size,ns_per_op\n");
+    report<16>(lib);
+    report<64>(lib);
+    report<256>(lib);
+    report<1024>(lib);
+    report<4000>(lib);
+    report<20000>(lib);
+    return 0;
+}
@@ -0,0 +1,345 @@
+/*
+ * t-test1 (test.c) as a timed benchmark: every thread keeps a pool of
+ * bins and frees and (re)allocates random ones with the same mix of
+ * malloc, calloc, realloc and memalign, for a fixed duration instead of a
+ * fixed number of rounds. Prints one CSV line per run, so that the same
+ * binary can be run as is (glibc) and under LD_PRELOAD (speedyLoc):
+ *
+ *   lib,dist,threads,seconds,ops,ops_per_sec,p50_ns,p99_ns,p999_ns,
+ *   peak_rss_kb,final_rss_kb
+ *
+ * Latencies are of single malloc/free calls, one in LAT_EVERY timed, and
+ * are the upper bounds of log-linear histogram buckets (within 12.5%).
+ * Peak RSS is the process high water mark, final RSS what is still
+ * resident once every thread has freed its bins and exited.
+ */
+#define _GNU_SOURCE
+
+#include <malloc.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/resource.h>
+#include <time.h>
+#include <unistd.h>
+
+#define MEMORY (1ULL << 26)  // bytes all bins may hold at once, as t-test1
+#define ACTIONS_MAX 30       // frees, then allocations, per round
+#define REALLOC_MAX 2000     // larger bins are not realloced
+#define LAT_EVERY 8          // time one operation out of this many
+#define LAT_SUB_BITS 3       // sub-buckets per power of two
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+#define THREAD_STACK (256 * 1024)
+
+/*
+ * size distribution of the allocations
+ * @attri name: as given with -z
+ * @attri min, max: bounds of the sizes
+ * @attri log: sizes log-uniform rather than uniform over [min, max]
+ */
+struct dist {
+    const char *name;
+    size_t min, max;
+    int log;
+};
+
+static const struct dist dists[] = {
+    {"small", 8, 512, 0},         // superblock classes only
+    {"ttest1", 1, 10000, 0},      // t-test1's default, sizes up to MSIZE
+    {"large", 4096, 1 << 20, 1},  // page spans
+    {"mixed", 8, 4 << 20, 1},     // every tier, big blocks included
+};
+#define NUM_DISTS (sizeof(dists) / sizeof(dists[0]))
+
+struct bin {
+    unsigned char *ptr;
+    size_t size;
+};
+
+/*
+ * per thread state and results
+ * @attri seed: of its RNG
+ * @attri bins: number of bins in its pool
+ * @attri ops: malloc/free calls made
+ * @attri lat: timed calls, by log-linear bucket of their ns
+ */
+struct worker {
+    pthread_t id;
+    unsigned long long seed;
+    size_t bins;
+    unsigned long long ops;
+    unsigned long long lat[LAT_BUCKETS];
+};
+
+static const struct dist *dist = &dists[1];
+static pthread_barrier_t start_barrier;
+static volatile int stop = 0;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * t-test1's RNG: a fast hash of a counter
+ */
+static inline unsigned rng(unsigned long long *seed)
+{
+    unsigned long long c = 7319936632422683443ULL;
+    unsigned long long x = (*seed += c);
+    x ^= x >> 32;
+    x *= c;
+    x ^= x >> 32;
+    x *= c;
+    x ^= x >> 32;
+    return x;
+}
+
+/*
+ * draw an allocation size from the distribution
+ */
+static size_t draw_size(unsigned long long *seed)
+{
+    if (!dist->log) return dist->min + rng(seed) % (dist->max - dist->min + 1);
+    // pick the power of two first, then a size within it
+    int lo = 63 - __builtin_clzll(dist->min);
+    int hi = 63 - __builtin_clzll(dist->max);
+    int lg = lo + rng(seed) % (hi - lo + 1);
+    size_t size = ((size_t)1 << lg) + rng(seed) % ((size_t)1 << lg);
+    if (size < dist->min) size = dist->min;
+    if (size > dist->max) size = dist->max;
+    return size;
+}
+
+/*
+ * mean of draw_size(), to size the pools like t-test1 does
+ */
+static size_t mean_size()
+{
+    if (!dist->log) return (dist->min + dist->max) / 2;
+    int lo = 63 - __builtin_clzll(dist->min);
+    int hi = 63 - __builtin_clzll(dist->max);
+    // 2^lg * 1.5 on average per power of two, before the clamping
+    return (((size_t)6 << hi) - ((size_t)3 << lo)) / 2 / (hi - lo + 1) + 1;
+}
+
+static inline int lat_bucket(unsigned long long ns)
+{
+    if (ns < (1 << LAT_SUB_BITS)) return (int)ns;
+    int lg = 63 - __builtin_clzll(ns);
+    int sub = (int)(ns >> (lg - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+    return ((lg - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
+
+/*
+ * upper bound, in ns, of the values in bucket $b
+ */
+static unsigned long long lat_bound(int b)
+{
+    if (b < (1 << LAT_SUB_BITS)) return b;
+    int lg = (b >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    unsigned long long sub = b & ((1 << LAT_SUB_BITS) - 1);
+    return ((1ULL << LAT_SUB_BITS) + sub + 1) << (lg - LAT_SUB_BITS);
+}
+
+/*
+ * t-test1's bin_alloc: memalign, calloc, realloc or malloc by $r
+ */
+static void bin_alloc(struct bin *m, size_t size, unsigned r)
+{
+    r %= 1024;
+    if (r < 4) {
+        if (m->size > 0) free(m->ptr);
+        m->ptr = memalign(sizeof(int) << r, size);
+    } else if (r < 20) {
+        if (m->size > 0) free(m->ptr);
+        m->ptr = calloc(size, 1);
+    } else if (r < 100 && m->size < REALLOC_MAX) {
+        if (!m->size) m->ptr = NULL;
+        m->ptr = realloc(m->ptr, size);
+    } else {
+        if (m->size > 0) free(m->ptr);
+        m->ptr = malloc(size);
+    }
+    if (!m->ptr) {
+        fprintf(stderr, "out of memory (size=%zu)\n", size);
+        exit(1);
+    }
+    m->ptr[0] = (unsigned char)size;  // touch it, as an application would
+    m->size = size;
+}
+
+static void bin_free(struct bin *m)
+{
+    if (!m->size) return;
+    free(m->ptr);
+    m->size = 0;
+}
+
+/*
+ * run one call on bin $m, timing it if it is the LAT_EVERY-th
+ */
+static void bin_op(struct worker *w, struct bin *m, int alloc)
+{
+    if (!alloc && !m->size) return;  // nothing to free, no call
+    if (++w->ops % LAT_EVERY != 0) {
+        if (alloc) {
+            bin_alloc(m, draw_size(&w->seed), rng(&w->seed));
+        } else {
+            bin_free(m);
+        }
+        return;
+    }
+    size_t size = draw_size(&w->seed);
+    unsigned r = rng(&w->seed);
+    double start = now_ns();
+    if (alloc) {
+        bin_alloc(m, size, r);
+    } else {
+        bin_free(m);
+    }
+    w->lat[lat_bucket((unsigned long long)(now_ns() - start))]++;
+}
+
+static void *worker_main(void *arg)
+{
+    struct worker *w = arg;
+    struct bin *pool = calloc(w->bins, sizeof(*pool));
+    size_t b;
+    unsigned j, actions;
+    for (b = 0; b < w->bins; b++) {
+        if (rng(&w->seed) % 2)
+            bin_alloc(&pool[b], draw_size(&w->seed), rng(&w->seed));
+    }
+
+    pthread_barrier_wait(&start_barrier);
+    while (!stop) {
+        actions = rng(&w->seed) % ACTIONS_MAX;
+        for (j = 0; j < actions; j++)
+            bin_op(w, &pool[rng(&w->seed) % w->bins], 0);
+        actions = rng(&w->seed) % ACTIONS_MAX;
+        for (j = 0; j < actions; j++)
+            bin_op(w, &pool[rng(&w->seed) % w->bins], 1);
+    }
+
+    for (b = 0; b < w->bins; b++) bin_free(&pool[b]);
+    free(pool);
+    return NULL;
+}
+
+static long rss_kb()
+{
+    long pages = 0, resident = 0;
+    FILE *f = fopen("/proc/self/statm", "r");
+    if (f == NULL) return -1;
+    if (fscanf(f, "%ld %ld", &pages, &resident) != 2) resident = -1;
+    fclose(f);
+    return resident < 0 ? -1 : resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void usage(const char *prog)
+{
+    size_t i;
+    fprintf(stderr,
+            "usage: %s [-l lib] [-t threads] [-z dist] [-d seconds] "
+            "[-m memory] [-H]\n  dists:",
+            prog);
+    for (i = 0; i < NUM_DISTS; i++) fprintf(stderr, " %s", dists[i].name);
+    fprintf(stderr, "\n  -H prints the CSV header and exits\n");
+    exit(2);
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = "default";
+    int threads = 2, opt, i;
+    double seconds = 2;
+    unsigned long long memory = MEMORY;
+    size_t d;
+
+    while ((opt = getopt(argc, argv, "l:t:z:d:m:H")) != -1) {
+        switch (opt) {
+            case 'l':
+                lib = optarg;
+                break;
+            case 't':
+                threads = atoi(optarg);
+                break;
+            case 'z':
+                for (d = 0; d < NUM_DISTS; d++)
+                    if (strcmp(optarg, dists[d].name) == 0) break;
+                if (d == NUM_DISTS) usage(argv[0]);
+                dist = &dists[d];
+                break;
+            case 'd':
+                seconds = atof(optarg);
+                break;
+            case 'm':
+                memory = strtoull(optarg, NULL, 0);
+                break;
+            case 'H':
+                printf("lib,dist,threads,seconds,ops,ops_per_sec,p50_ns,"
+                       "p99_ns,p999_ns,peak_rss_kb,final_rss_kb\n");
+                return 0;
+            default:
+                usage(argv[0]);
+        }
+    }
+    if (threads < 1 || seconds <= 0) usage(argv[0]);
+
+    size_t bins = memory / (mean_size() * threads);
+    if (bins < 4) bins = 4;
+    struct worker *workers = calloc(threads, sizeof(*workers));
+    pthread_attr_t attr;
+    pthread_attr_init(&attr);
+    pthread_attr_setstacksize(&attr, THREAD_STACK);
+    pthread_barrier_init(&start_barrier, NULL, threads + 1);
+    for (i = 0; i < threads; i++) {
+        workers[i].seed = (unsigned long long)i * 0x9E3779B97F4A7C15ULL + 1;
+        workers[i].bins = bins;
+        if (pthread_create(&workers[i].id, &attr, worker_main, &workers[i])) {
+            fprintf(stderr, "creating thread #%d failed\n", i);
+            return 1;
+        }
+    }
+
+    // every pool is filled: time the steady state only
+    pthread_barrier_wait(&start_barrier);
+    double start = now_ns();
+    struct timespec ts = {(time_t)seconds,
+                          (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    stop = 1;
+    double elapsed = (now_ns() - start) / 1e9;
+
+    unsigned long long ops = 0, timed = 0, lat[LAT_BUCKETS] = {0};
+    int b;
+    for (i = 0; i < threads; i++) {
+        pthread_join(workers[i].id, NULL);
+        ops += workers[i].ops;
+        for (b = 0; b < LAT_BUCKETS; b++) lat[b] += workers[i].lat[b];
+    }
+    for (b = 0; b < LAT_BUCKETS; b++) timed += lat[b];
+
+    // percentiles, as the bound of the bucket they fall in
+    const double pcts[] = {0.50, 0.99, 0.999};
+    unsigned long long pvals[3] = {0, 0, 0}, seen = 0;
+    int p = 0;
+    for (b = 0; b < LAT_BUCKETS && p < 3; b++) {
+        seen += lat[b];
+        while (p < 3 && timed > 0 && seen >= pcts[p] * timed)
+            pvals[p++] = lat_bound(b);
+    }
+
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    printf("%s,%s,%d,%.2f,%llu,%.0f,%llu,%llu,%llu,%ld,%ld\n", lib,
+           dist->name, threads, elapsed, ops, ops / elapsed, pvals[0],
+           pvals[1], pvals[2], ru.ru_maxrss, rss_kb());
+    free(workers);
+    return 0;
+}
@@ -0,0 +1,122 @@
+#include <linux/perf_event.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+#define NUM_OBJECTS (1 << 20)
+#define OBJECT_SIZE 96
+#define CHASE_STEPS (1 << 24)
+#define CHURN_ROUNDS 8
+
+typedef struct node {
+    struct node *next;
+    char pad[OBJECT_SIZE - sizeof(struct node *)];
+} node_t;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+/*
+ * counter of dTLB load misses of this thread, -1 if perf is unavailable
+ */
+static int open_dtlb_counter()
+{
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_TYPE_HW_CACHE;
+    attr.config = PERF_COUNT_HW_CACHE_DTLB |
+                  (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+                  (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+    attr.disabled = 1;
+    attr.exclude_kernel = 1;
+    return syscall(SYS_perf_event_open, &attr, 0, -1, -1, 0);
+}
+
+static long long read_counter(int fd)
+{
+    long long count;
+    if (fd < 0 || read(fd, &count, sizeof(count)) != sizeof(count))
+        return -1;
+    return count;
+}
+
+/*
+ * kB of this process backed by transparent huge pages
+ */
+static long anon_huge_kb()
+{
+    char line[256];
+    long kb = 0, v;
+    FILE *f = fopen("/proc/self/smaps_rollup", "r");
+    if (f == NULL) return -1;
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (sscanf(line, "AnonHugePages: %ld kB", &v) == 1) kb += v;
+    }
+    fclose(f);
+    return kb;
+}
+
+/*
+ * link every object into one ring in random order, so the chase below
+ * touches a different page on nearly every step
+ */
+static void shuffle_ring(node_t **objs, long n)
+{
+    long i;
+    for (i = n - 1; i > 0; i--) {
+        long j = random() % (i + 1);
+        node_t *tmp = objs[i];
+        objs[i] = objs[j];
+        objs[j] = tmp;
+    }
+    for (i = 0; i < n; i++) objs[i]->next = objs[(i + 1) % n];
+}
+
+int main(int argc, char **argv)
+{
+    const char *mode = argc > 1 ? argv[1] : "default";
+    node_t **objs = malloc(NUM_OBJECTS * sizeof(node_t *));
+    long i, r;
+
+    // malloc/free throughput over a large live set
+    double start = now_ns();
+    for (i = 0; i < NUM_OBJECTS; i++) objs[i] = malloc(sizeof(node_t));
+    for (r = 0; r < CHURN_ROUNDS; r++) {
+        for (i = r & 1; i < NUM_OBJECTS; i += 2) {
+            free(objs[i]);
+            objs[i] = malloc(sizeof(node_t));
+        }
+    }
+    double churn = (now_ns() - start) /
+                   (NUM_OBJECTS + (double)CHURN_ROUNDS * NUM_OBJECTS);
+
+    // pointer chase through the live set
+    shuffle_ring(objs, NUM_OBJECTS);
+    int fd = open_dtlb_counter();
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_ENABLE, 0);
+    node_t *p = objs[0];
+    start = now_ns();
+    for (i = 0; i < CHASE_STEPS; i++) p = p->next;
+    double chase = (now_ns() - start) / CHASE_STEPS;
+    if (fd >= 0) ioctl(fd, PERF_EVENT_IOC_DISABLE, 0);
+    long long misses = read_counter(fd);
+
+    printf("mode,malloc_ns_per_op,chase_ns_per_step,dtlb_misses,"
+           "anon_huge_kb\n");
+    printf("%s,%.2f,%.2f,%lld,%ld\n", mode, churn, chase, misses,
+           anon_huge_kb());
+    if (p == NULL) return 1;  // keep the chase alive
+    for (i = 0; i < NUM_OBJECTS; i++) free(objs[i]);
+    free(objs);
+    return 0;
+}
@@ -0,0 +1,65 @@
+/*
+ * Hoard's threadtest: every thread allocates a batch of small objects and
+ * frees them all again, ITERATIONS times. The total work is fixed and
+ * split over the threads, so a scalable allocator keeps the time flat as
+ * threads are added; all frees are local.
+ *
+ *   usage: threadtest <lib> <threads>
+ *   prints lib,bench,threads,seconds,ops_per_sec
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define ITERATIONS 50
+#define OBJECTS 300000  // per iteration, over all threads
+#define OBJECT_SIZE 8
+#define WORK 0          // busy loop per object, as in the original
+
+static int threads;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *worker(void *arg)
+{
+    int n = OBJECTS / threads, i, j, w;
+    char **objs = malloc(n * sizeof(*objs));
+    (void)arg;
+    for (i = 0; i < ITERATIONS; i++) {
+        for (j = 0; j < n; j++) {
+            objs[j] = malloc(OBJECT_SIZE);
+            for (w = 0; w < WORK; w++) objs[j][w % OBJECT_SIZE] = (char)w;
+            objs[j][0] = (char)j;
+        }
+        for (j = 0; j < n; j++) free(objs[j]);
+    }
+    free(objs);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = argc > 1 ? argv[1] : "default";
+    threads = argc > 2 ? atoi(argv[2]) : 1;
+    int i;
+    if (threads < 1) threads = 1;
+
+    pthread_t *ids = malloc(threads * sizeof(*ids));
+    double start = now_ns();
+    for (i = 0; i < threads; i++) pthread_create(&ids[i], NULL, worker, NULL);
+    for (i = 0; i < threads; i++) pthread_join(ids[i], NULL);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // one malloc/free pair per object
+    double ops = (double)ITERATIONS * (OBJECTS / threads) * threads;
+    printf("%s,threadtest,%d,%.2f,%.0f\n", lib, threads, elapsed,
+           ops / elapsed);
+    free(ids);
+    return 0;
+}
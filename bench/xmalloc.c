@@ -0,0 +1,132 @@
+/*
+ * xmalloc-test's producer/consumer: half of the threads allocate blocks
+ * and pass them in batches through a shared queue to the other half,
+ * which frees them. Every free is remote, so this is the worst case for
+ * the remote-free path and for how quickly freed blocks get back to the
+ * CPU that allocates. The queue is bounded so that memory stays flat.
+ *
+ *   usage: xmalloc <lib> <threads> [seconds]
+ *   runs max(1, threads / 2) producers and as many consumers
+ *   prints lib,bench,threads,seconds,ops_per_sec
+ */
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <time.h>
+
+#define BATCH 64        // blocks per batch
+#define MAX_BATCHES 64  // queued before producers wait
+#define MIN_SIZE 8
+#define MAX_SIZE 512
+
+/*
+ * blocks in transit from a producer to a consumer
+ * @attri next: in the queue
+ */
+struct batch {
+    struct batch *next;
+    void *blocks[BATCH];
+};
+
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_not_empty = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_not_full = PTHREAD_COND_INITIALIZER;
+static struct batch *queue = NULL;
+static int queued = 0;
+static volatile int stop = 0;
+static int producers_done = 0;  // under queue_lock
+static unsigned long long freed = 0;
+
+static double now_ns()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
+
+static void *producer(void *arg)
+{
+    unsigned seed = (unsigned)(size_t)arg;
+    int i;
+    while (!stop) {
+        struct batch *b = malloc(sizeof(*b));
+        for (i = 0; i < BATCH; i++) {
+            size_t size = MIN_SIZE + rand_r(&seed) % (MAX_SIZE - MIN_SIZE);
+            b->blocks[i] = malloc(size);
+            ((char *)b->blocks[i])[0] = (char)size;
+        }
+        pthread_mutex_lock(&queue_lock);
+        while (queued >= MAX_BATCHES && !stop)
+            pthread_cond_wait(&queue_not_full, &queue_lock);
+        b->next = queue;
+        queue = b;
+        queued++;
+        pthread_cond_signal(&queue_not_empty);
+        pthread_mutex_unlock(&queue_lock);
+    }
+    return NULL;
+}
+
+static void *consumer(void *arg)
+{
+    unsigned long long count = 0;
+    int i;
+    (void)arg;
+    for (;;) {
+        pthread_mutex_lock(&queue_lock);
+        while (queue == NULL && !producers_done)
+            pthread_cond_wait(&queue_not_empty, &queue_lock);
+        struct batch *b = queue;
+        if (b == NULL) {
+            pthread_mutex_unlock(&queue_lock);
+            break;
+        }
+        queue = b->next;
+        queued--;
+        pthread_cond_signal(&queue_not_full);
+        pthread_mutex_unlock(&queue_lock);
+
+        for (i = 0; i < BATCH; i++) free(b->blocks[i]);
+        free(b);
+        if (!stop) count += BATCH;
+    }
+    __atomic_fetch_add(&freed, count, __ATOMIC_RELAXED);
+    return NULL;
+}
+
+int main(int argc, char **argv)
+{
+    const char *lib = argc > 1 ? argv[1] : "default";
+    int threads = argc > 2 ? atoi(argv[2]) : 2;
+    double seconds = argc > 3 ? atof(argv[3]) : 3;
+    int i, pairs = threads / 2 > 0 ? threads / 2 : 1;
+
+    pthread_t *ids = malloc(2 * pairs * sizeof(*ids));
+    double start = now_ns();
+    for (i = 0; i < pairs; i++) {
+        pthread_create(&ids[2 * i], NULL, producer, (void *)(size_t)(i + 1));
+        pthread_create(&ids[2 * i + 1], NULL, consumer, NULL);
+    }
+    struct timespec ts = {(time_t)seconds,
+                          (long)((seconds - (time_t)seconds) * 1e9)};
+    nanosleep(&ts, NULL);
+    pthread_mutex_lock(&queue_lock);
+    stop = 1;
+    pthread_cond_broadcast(&queue_not_full);
+    pthread_mutex_unlock(&queue_lock);
+    double elapsed = (now_ns() - start) / 1e9;
+
+    // producers first, so that the consumers drain every last batch
+    for (i = 0; i < pairs; i++) pthread_join(ids[2 * i], NULL);
+    pthread_mutex_lock(&queue_lock);
+    producers_done = 1;
+    pthread_cond_broadcast(&queue_not_empty);
+    pthread_mutex_unlock(&queue_lock);
+    for (i = 0; i < pairs; i++) pthread_join(ids[2 * i + 1], NULL);
+
+    // one malloc/free pair per block freed while timed
+    printf("%s,xmalloc,%d,%.2f,%.0f\n", lib, 2 * pairs, elapsed,
+           freed / elapsed);
+    free(ids);
+    return 0;
+}
@@ -0,0 +1,152 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Cache of recently freed big blocks.
+ *
+ * Big block lengths are rounded to four steps per power of two (at most
+ * 25% slack, never less than a page), so that mappings of close sizes
+ * share a bucket. A freed mapping of at most BIG_CACHE_MAX_LEN bytes is
+ * kept in its bucket instead of being unmapped, while the cache holds
+ * less than BIG_CACHE_BYTES; a later request of the same bucket takes it
+ * back without any syscall. Cached mappings are linked through their
+ * first user word, stamped with the time they were cached in the second
+ * one, and keep their (dirty) contents. purge_tick() unmaps the ones
+ * that stayed unused for purge_decay_ms, malloc_trim() all of them.
+ */
+
+static big_block_h_t *big_cache[BIG_CACHE_BUCKETS];
+static size_t big_cache_bytes = 0;
+static pthread_mutex_t big_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define CACHED_NEXT(b) (*(big_block_h_t **)((b) + 1))
+#define CACHED_SINCE(b) (((uint64_t *)((b) + 1))[1])
+
+/*
+ * mapped length of a big block of $size bytes, header included
+ */
+size_t big_block_length(size_t size)
+{
+    size_t len = (size + sys_page_size - 1) & ~((size_t)sys_page_size - 1);
+    if (len > BIG_CACHE_MAX_LEN) return len;
+    size_t step = ((size_t)1 << lg_floor(len)) >> 2;
+    if (step < (size_t)sys_page_size) return len;
+    return (len + step - 1) & ~(step - 1);
+}
+
+/*
+ * bucket of a length returned by big_block_length(), -1 if not cached
+ */
+static int big_cache_bucket(size_t len)
+{
+    if (len > BIG_CACHE_MAX_LEN) return -1;
+    int lg = lg_floor(len);
+    return (lg - PAGEMAP_PAGE_SHIFT) * 4 + (int)((len >> (lg - 2)) & 3);
+}
+
+/*
+ * take a cached mapping of exactly $len bytes, NULL if none
+ */
+big_block_h_t *big_cache_get(size_t len)
+{
+    int bucket = big_cache_bucket(len);
+    if (bucket < 0) return NULL;
+
+    pthread_mutex_lock(&big_cache_lock);
+    big_block_h_t *big = big_cache[bucket];
+    if (big != NULL) {
+        big_cache[bucket] = CACHED_NEXT(big);
+        big_cache_bytes -= len;
+    }
+    pthread_mutex_unlock(&big_cache_lock);
+    return big;
+}
+
+/*
+ * keep a freed big block for reuse;
+ * returns 0 if it does not fit, the caller unmaps it then
+ */
+int big_cache_put(big_block_h_t *big)
+{
+    int bucket = big_cache_bucket(big->length);
+    if (bucket < 0) return 0;
+
+    pthread_mutex_lock(&big_cache_lock);
+    if (big_cache_bytes + big->length > BIG_CACHE_BYTES) {
+        pthread_mutex_unlock(&big_cache_lock);
+        return 0;
+    }
+    CACHED_NEXT(big) = big_cache[bucket];
+    CACHED_SINCE(big) = purge_clock_ms();
+    big_cache[bucket] = big;
+    big_cache_bytes += big->length;
+    pthread_mutex_unlock(&big_cache_lock);
+    return 1;
+}
+
+/*
+ * bytes held by the cache
+ */
+size_t big_cache_size()
+{
+    return __atomic_load_n(&big_cache_bytes, __ATOMIC_RELAXED);
+}
+
+/*
+ * unmap every mapping cached for $decay_ms at least; buckets are in
+ * caching order, newest first, so the stale ones are a tail of each;
+ * big_cache_lock must be held; returns the number of bytes released
+ */
+static size_t big_cache_release(uint64_t decay_ms)
+{
+    uint64_t now = purge_clock_ms();
+    size_t released = 0;
+    int i;
+    for (i = 0; i < BIG_CACHE_BUCKETS; i++) {
+        big_block_h_t **link = &big_cache[i];
+        while (*link != NULL && now - CACHED_SINCE(*link) < decay_ms)
+            link = &CACHED_NEXT(*link);
+        big_block_h_t *big = *link;
+        *link = NULL;
+        while (big != NULL) {
+            big_block_h_t *next = CACHED_NEXT(big);
+            released += big->length;
+            munmap(big, big->length);
+            big = next;
+        }
+    }
+    big_cache_bytes -= released;
+    return released;
+}
+
+/*
+ * unmap every cached mapping; returns the number of bytes released
+ */
+size_t big_cache_flush()
+{
+    pthread_mutex_lock(&big_cache_lock);
+    size_t released = big_cache_release(0);
+    pthread_mutex_unlock(&big_cache_lock);
+    return released;
+}
+
+/*
+ * called from purge_tick(): unmap the cached mappings whose decay ran
+ * out, unless the cache is busy; returns the number of bytes released
+ */
+size_t big_cache_decay(uint64_t decay_ms)
+{
+    if (pthread_mutex_trylock(&big_cache_lock) != 0) return 0;
+    size_t released = big_cache_release(decay_ms);
+    pthread_mutex_unlock(&big_cache_lock);
+    return released;
+}
@@ -0,0 +1,58 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#ifdef __SSE2__
+#include <emmintrin.h>
+#endif
+#include "common.h"
+
+/*
+ * zero $len bytes at $ptr; runs of CALLOC_STREAM_MIN bytes and more are
+ * written with non-temporal stores, so that they do not evict the cache
+ */
+void zero_block(void *ptr, size_t len)
+{
+#ifdef __SSE2__
+    if (len >= CALLOC_STREAM_MIN) {
+        char *p = ptr, *end = p + len;
+        char *lo = (char *)(((uintptr_t)p + 63) & ~(uintptr_t)63);
+        char *hi = (char *)((uintptr_t)end & ~(uintptr_t)63);
+        __m128i zero = _mm_setzero_si128();
+        memset(p, 0, lo - p);
+        for (; lo < hi; lo += 64) {
+            _mm_stream_si128((__m128i *)lo, zero);
+            _mm_stream_si128((__m128i *)(lo + 16), zero);
+            _mm_stream_si128((__m128i *)(lo + 32), zero);
+            _mm_stream_si128((__m128i *)(lo + 48), zero);
+        }
+        memset(hi, 0, end - hi);
+        _mm_sfence();
+        return;
+    }
+#endif
+    memset(ptr, 0, len);
+}
+
+/*
+ * allocate $nmemb * $size zeroed bytes; spans and mappings fresh from
+ * the OS are zero already and skip the memset. Fails with ENOMEM if the
+ * product overflows, or is too big for allocate_block() to add a header
+ */
+void *__lib_calloc(size_t nmemb, size_t size)
+{
+    size_t total;
+    if (__builtin_mul_overflow(nmemb, size, &total)) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return allocate_block(total, 1);
+}
+
+void *calloc(size_t nmemb, size_t size)
+    __attribute__((weak, alias("__lib_calloc")));
@@ -0,0 +1,151 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Compare-and-swap backend for the per-CPU critical sections.
+ *
+ * Used when neither the upcall driver nor rseq is available. Nothing
+ * restarts us here, so a thread may be migrated between sched_getcpu()
+ * and its update: every change to local_head is therefore a CAS on the
+ * tagged pointer, and any thread may safely touch any superblock. The
+ * tag is bumped on every update so that a head popped and pushed back
+ * by someone else in between (ABA) fails our CAS.
+ */
+
+/*
+ * cas flavour of restartable_critical_section:
+ * pops the local head of the current CPU's superblock;
+ * returns NULL if the slow path should be taken
+ */
+block_h_t *cas_critical_section(int sc)
+{
+    my_cpu = current_cpu_heap();
+    if (my_cpu < 0) return NULL;
+
+    superblock_h_t *sbptr =
+        __atomic_load_n(&cpu_heaps[my_cpu].bins[sc], __ATOMIC_ACQUIRE);
+    if (sbptr == NULL || !reserve_blocks(sbptr, 1)) return NULL;
+
+    void *old = __atomic_load_n(&sbptr->local_head, __ATOMIC_ACQUIRE);
+    block_h_t *bptr;
+    do {
+        bptr = (block_h_t *)TAGGED_PTR(old);
+        if (bptr == NULL) {
+            unreserve_blocks(sbptr, 1);
+            return NULL;
+        }
+        // may read a stale next if bptr was popped meanwhile, but then
+        // the tag has moved on and the CAS below fails
+    } while (!__atomic_compare_exchange_n(&sbptr->local_head, &old,
+                                          TAG_SUCCESSOR(old, bptr->next), true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return bptr;
+}
+
+/*
+ * cas flavour of restartable_critical_section_batch:
+ * pops up to $max blocks off the current CPU's superblock in one CAS;
+ * returns the number of blocks, NULL terminated at *firstp
+ */
+int cas_critical_section_batch(int sc, int max, block_h_t **firstp)
+{
+    my_cpu = current_cpu_heap();
+    if (my_cpu < 0) return 0;
+
+    superblock_h_t *sbptr =
+        __atomic_load_n(&cpu_heaps[my_cpu].bins[sc], __ATOMIC_ACQUIRE);
+    if (sbptr == NULL || !reserve_blocks(sbptr, max)) return 0;
+
+    void *old = __atomic_load_n(&sbptr->local_head, __ATOMIC_ACQUIRE);
+    block_h_t *first, *last, *rest;
+    int count;
+    do {
+        first = (block_h_t *)TAGGED_PTR(old);
+        if (first == NULL) {
+            unreserve_blocks(sbptr, max);
+            return 0;
+        }
+        // the walk may follow links of blocks popped meanwhile: stop at
+        // anything outside this superblock (always mapped), and let the
+        // tag reject the CAS
+        last = first;
+        count = 1;
+        while ((rest = last->next) != NULL && count < max) {
+            if (SUPERBLOCK_OF(rest) != sbptr) break;
+            last = rest;
+            count++;
+        }
+    } while (!__atomic_compare_exchange_n(&sbptr->local_head, &old,
+                                          TAG_SUCCESSOR(old, rest), true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    last->next = NULL;
+    unreserve_blocks(sbptr, max - count);
+    *firstp = first;
+    return count;
+}
+
+/*
+ * cas flavour of restartable_critical_section_free:
+ * returns 0 if slow path is taken;
+ * returns 1 if fast path is taken;
+ */
+int cas_critical_section_free(superblock_h_t *mama_s, block_h_t *first,
+                              block_h_t *last, int count)
+{
+    size_t sc = mama_s->size_class;
+
+    my_cpu = current_cpu_heap();
+    if (my_cpu < 0) return 0;
+
+    // only blocks of the current CPU's superblock go to the local list
+    if (__atomic_load_n(&cpu_heaps[my_cpu].bins[sc], __ATOMIC_ACQUIRE) !=
+        mama_s)
+        return 0;
+
+    cas_push_local_chain(mama_s, first, last);
+    int in_use =
+        __atomic_sub_fetch(&mama_s->in_use_count, count, __ATOMIC_SEQ_CST);
+    // swapped out between the check and the push: the global heap may
+    // have sorted it before these blocks came back, as for a remote free
+    if (__atomic_load_n(&cpu_heaps[my_cpu].bins[sc], __ATOMIC_SEQ_CST) !=
+        mama_s)
+        settle_superblock_fill(mama_s, in_use, 1);
+    return 1;
+}
+
+/*
+ * install $new_sbptr as $cpu's superblock for $sc if $old_sbptr is still
+ * there; fails if another thread swapped it first
+ */
+int cas_install_superblock(int cpu, int sc, superblock_h_t *old_sbptr,
+                           superblock_h_t *new_sbptr)
+{
+    return __atomic_compare_exchange_n(&cpu_heaps[cpu].bins[sc], &old_sbptr,
+                                       new_sbptr, false, __ATOMIC_ACQ_REL,
+                                       __ATOMIC_ACQUIRE);
+}
+
+/*
+ * push the chain first->...->last onto the local list of $sbptr;
+ * safe against concurrent pops and pushes of any engine
+ */
+void cas_push_local_chain(superblock_h_t *sbptr, block_h_t *first,
+                          block_h_t *last)
+{
+    void *old = __atomic_load_n(&sbptr->local_head, __ATOMIC_ACQUIRE);
+    do {
+        last->next = (block_h_t *)TAGGED_PTR(old);
+    } while (!__atomic_compare_exchange_n(&sbptr->local_head, &old,
+                                          TAG_SUCCESSOR(old, first), true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+}
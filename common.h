@@ -22,75 +22,344 @@
 #define INVALID 1
 
 #define MAX_BINS 64  // FIXME: number of size classes
+#define BIG_BLOCK_CLASS (MAX_BINS + 1)
 #define FLAT_CLASS_NO 377
-#define MAX_SYS_CORE_COUNT 64  // default val
+#define MAX_SYS_CORE_COUNT 64  // counter shards, and default core count
 #define SYS_PAGE_SIZE 4096     // default val
+#define PAGEMAP_PAGE_SHIFT 12  // page map granularity, <= any sys page
+#define CACHE_LINE_SIZE 64
+#define SB_SHIFT 16
+#define SB_SIZE ((size_t)1 << SB_SHIFT)  // every superblock, aligned to it
+#define SUPERBLOCK_OF(p) \
+    ((superblock_h_t *)((uintptr_t)(p) & ~(uintptr_t)(SB_SIZE - 1)))
 #define MAX_SML_SIZE 1024
 #define MAX_LRG_SIZE 4096
+#define MAX_SPAN_CLASS_SIZE 32768  // larger spans are sized by the page
+#define MAX_SPAN_SIZE ((size_t)1 << 20)  // larger blocks are mmapped alone
 #define SML_ALIGN 8
 #define LRG_ALIGN 128
 #define REAL_SML_ALIGN 16
 #define SML_SIZE_CLASS_IDX(s) ((uint32_t)(s) + 7) >> 3
 #define LRG_SIZE_CLASS_IDX(s) ((uint32_t)(s) + 127 + (120 << 7)) >> 7
 
+// engines backing the restartable critical sections
+#define ENGINE_SIGNAL 0  // kprobe driver upcall + longjmp
+#define ENGINE_RSEQ 1    // kernel restartable sequences
+#define ENGINE_CAS 2     // tagged-pointer compare-and-swap, no kernel help
+
+// states of a thread cache
+#define TCACHE_UNUSED 0
+#define TCACHE_LIVE 1
+#define TCACHE_DEAD 2
+
+// superblocks are carved from one reserved virtual arena
+#define ARENA_SIZE ((size_t)1 << 36)    // 64GB of address space
+#define ARENA_CHUNK_SIZE (16 * SB_SIZE)  // taken by a CPU heap at a time
+#define HUGE_PAGE_SIZE ((size_t)2 << 20)  // chunk size in huge page mode
+
+// huge page modes of the arena (SPEEDYLOC_THP)
+#define THP_OFF 0
+#define THP_MADVISE 1  // transparent huge pages, MADV_HUGEPAGE
+#define THP_HUGETLB 2  // MAP_HUGETLB, THP_MADVISE when none is reserved
+
+// empty superblocks go back to the OS after this long (SPEEDYLOC_DECAY_MS)
+#define PURGE_DECAY_MS 10000
+#define PURGE_INTERVAL_MS 100  // least time between two purge passes
+#define PURGE_TICK_FREES 4096  // frees of a thread between two purge checks
+
+// page heap for medium blocks, see span.c
+#define SPAN_PAGE_SHIFT PAGEMAP_PAGE_SHIFT
+#define SPAN_PAGE_SIZE ((size_t)1 << SPAN_PAGE_SHIFT)
+#define SPAN_MAX_PAGES (MAX_SPAN_SIZE >> SPAN_PAGE_SHIFT)  // own free lists
+#define SPAN_GROW_PAGES 256  // least pages taken off the arena at a time
+
+// freed big blocks up to BIG_CACHE_MAX_LEN are kept for reuse
+#define BIG_CACHE_MAX_SHIFT 24
+#define BIG_CACHE_MAX_LEN ((size_t)1 << BIG_CACHE_MAX_SHIFT)
+#define BIG_CACHE_BUCKETS ((BIG_CACHE_MAX_SHIFT - PAGEMAP_PAGE_SHIFT + 1) * 4)
+#define BIG_CACHE_BYTES ((size_t)64 << 20)  // most bytes cached at once
+
+// calloc zeroes runs this long with non-temporal stores
+#define CALLOC_STREAM_MIN ((size_t)1 << 20)
+
+// telemetry events (SPEEDYLOC_TELEMETRY), see telemetry.c
+#define TELEM_FAST_MALLOC 0     // block popped by a critical section
+#define TELEM_FAST_FREE 1       // chain pushed by a critical section
+#define TELEM_SLOW_REFILL 2     // local list refilled from remote or bump
+#define TELEM_NEW_SUPERBLOCK 3  // superblock from the global heap or new
+#define TELEM_UPCALL 4          // SIG_UPCALL received, counted only
+#define TELEM_RESTART 5         // critical section restarted
+#define TELEM_REMOTE_FREE 6     // chain pushed to a remote list
+#define TELEM_REMOTE_RETRY 7    // remote push lost its CAS, retried
+#define TELEM_LOCK_WAIT 8       // global_heap_lock found held
+#define TELEM_EVENTS 9
+#define TELEM_BUCKETS 40  // log2 cycle histogram
+
+// sampling heap profiler (SPEEDYLOC_PROFILE), see profile.c
+#define PROFILE_RATE (512 * 1024)  // mean bytes between two samples
+#define PROFILE_DEPTH 32           // frames kept per stack trace
+#define PROFILE_SKIP 2             // frames of the profiler and allocator
+#define PROFILE_SAMPLE_BITS 12     // live samples hashed by address
+#define PROFILE_STACK_BITS 12      // stack traces hashed by frames
+#define PROFILE_POOL ((size_t)1 << 20)  // records are mmapped this much at once
+#define PROFILE_DUMP_SIGNAL SIGUSR2
+
+// global heap lists a superblock no CPU owns sits on, by fill
+#define SB_EMPTY 0    // no block in use
+#define SB_PARTIAL 1  // some blocks free
+#define SB_FULL 2     // no free block left
+#define SB_NUM_LISTS 3
+#define SB_DETACHED SB_NUM_LISTS  // on no list: owned by a CPU or in transit
+#define SB_PURGING (-(1 << 30))  // added to in_use_count while it is purged
+
+// local_head and remote_head hold tagged pointers: the upper 16 bits count
+// the updates made through them (ABA guard), the lower 48 are the address
+#define TAG_SHIFT 48
+#define TAG_ONE ((uintptr_t)1 << TAG_SHIFT)
+#define TAG_MASK (~(uintptr_t)0 << TAG_SHIFT)
+#define TAGGED_PTR(t) ((void *)((uintptr_t)(t) & ~TAG_MASK))
+#define TAG_SUCCESSOR(t, p) \
+    ((void *)((((uintptr_t)(t) + TAG_ONE) & TAG_MASK) | (uintptr_t)(p)))
+
 /*
- * struct for a memory block in the buddy system
- * @attri size_class: size class from 0 to MAX_BINS
+ * struct for a free memory block of a superblock; blocks in use carry
+ * no header at all, their size class comes from the owning superblock
  * @attri next: pointer to the cloest next block with the same size
+ * @attri tail: last block of the remote list this block heads; only
+ *              meaningful at the head of a remote list (blocks are >= 16B)
  */
 typedef struct _block_header {
-    uint8_t size_class;
     struct _block_header *next;
+    struct _block_header *tail;
 } block_h_t;
 
 /*
- * struct for a superblock of a (heap, size_class)
- * @attri in_use_count: number of blocks in use
- * @attri local_head: addr for the first local block_h_t
- * @attri remote_head: addr for the first remote (freed) block_h_t
+ * struct in front of a block too big for any size class, mmapped alone
+ * @attri size_class: always BIG_BLOCK_CLASS
+ * @attri length: mapped length, header included
+ */
+typedef struct _big_block_header {
+    uint8_t size_class;
+    size_t length;
+} __attribute__((aligned(16))) big_block_h_t;
+
+// largest request whose big block header and page rounding do not wrap
+#define MAX_BLOCK_SIZE \
+    (SIZE_MAX - sizeof(big_block_h_t) - (size_t)sys_page_size)
+
+/*
+ * struct for a span of the page heap, a run of whole pages in the span
+ * half of the arena; kept apart from its pages
+ * @attri start: first byte of the span
+ * @attri pages: length in SPAN_PAGE_SIZE pages
+ * @attri size_class: span class it serves, 0 if none
+ * @attri free: set while on a free list
+ * @attri clean: free and none of its pages resident
+ * @attri free_since: when it was last freed or merged, in ms
+ * @attri next, prev: free list links
+ */
+typedef struct _span {
+    char *start;
+    size_t pages;
+    uint8_t size_class;
+    uint8_t free;
+    uint8_t clean;
+    uint64_t free_since;
+    struct _span *next;
+    struct _span *prev;
+} span_t;
+
+/*
+ * struct for a superblock of a (heap, size_class), it sits at the start
+ * of its SB_SIZE aligned region, on cache lines of its own
+ * @attri size_class: size class of its blocks
+ * @attri list: global heap list it sits on, SB_DETACHED if none
+ * @attri pending: set while it waits on the pending stack of global heap
+ * @attri clean: no page of it but the header's is resident
+ * @attri in_use_count: number of blocks in use, or about to be popped
+ * @attri local_head: tagged addr for the first local block_h_t
+ * @attri remote_head: tagged addr for the first remote (freed) block_h_t
  * @attri next: points to the next same-sized superblock (for global heap)
- * @attri lock: lock used in slow path
+ * @attri prev: points to the previous one on the same global heap list
+ * @attri pending_next: next superblock on the pending stack
+ * @attri bump: first block never handed out, blocks are carved from here
+ * @attri empty_since: when it got on the SB_EMPTY list, in ms
  */
 typedef struct _superblock_header {
+    uint8_t size_class;
+    uint8_t list;
+    uint8_t pending;
+    uint8_t clean;
     int in_use_count;
     void *local_head;
     void *remote_head;
     struct _superblock_header *next;  // by default NULL
-    pthread_mutex_t lock;
-} superblock_h_t;
+    struct _superblock_header *prev;
+    struct _superblock_header *pending_next;
+    char *bump;
+    uint64_t empty_since;
+} __attribute__((aligned(CACHE_LINE_SIZE))) superblock_h_t;
 
 /*
  * struct for a heap of a CPU
  * @attri cpu: determine CPU for which the heap is allocated
  * @attri bins: list of superblocks allocated, index refers to size_class
+ * @attri chunk: next superblock region of its current arena chunk
  */
 typedef struct _heap_header {
     unsigned int cpu;
     superblock_h_t *bins[MAX_BINS];
+    char *chunk;
 } heap_h_t;
 
 /*
- * struct for malloc info
- * @attri arena: total number of bytes allocated with mmap/sbrk
- * @attri narenas: number of arenas
+ * struct for the global heap, holding the superblocks no CPU owns;
+ * every list is doubly linked so that a superblock moves in O(1)
+ * @attri lists: SB_EMPTY, SB_PARTIAL and SB_FULL lists per size class
+ * @attri pending: per size class, stack of superblocks a remote free may
+ *                 have moved to another list; pushed lock-free, drained
+ *                 under global_heap_lock
+ */
+typedef struct _global_heap_header {
+    superblock_h_t *lists[SB_NUM_LISTS][MAX_BINS];
+    superblock_h_t *pending[MAX_BINS];
+} global_heap_h_t;
+
+/*
+ * struct for the per thread cache in front of the CPU heaps
+ * @attri heads: NULL terminated list of cached free blocks per size class
+ * @attri counts: length of each list
+ * @attri state: TCACHE_UNUSED, TCACHE_LIVE or TCACHE_DEAD (thread exited)
+ */
+typedef struct _thread_cache {
+    block_h_t *heads[MAX_BINS];
+    int counts[MAX_BINS];
+    int state;
+} thread_cache_t;
+
+/*
+ * struct for malloc info, summed over the stats shards
+ * @attri arena: total number of bytes allocated with mmap
+ * @attri narenas: number of arenas (CPU heaps)
  * @attri alloreqs: number of allocation requests
  * @attri freereqs: number of free requests
  * @attri alloblks: number of allocated blocks
- * @attri freeblks: number of free blocks
+ * @attri freeblks: number of free blocks (free spans, cached big blocks)
  * @attri uordblks: total allocated space in bytes
  * @attri fordblks: total free space in bytes
+ * @attri bigblks: number of big blocks in use
+ * @attri bigbytes: bytes mapped for big blocks in use
+ * @attri cachedbytes: bytes of freed big blocks kept for reuse
  */
 typedef struct _mallinfo {
-    int arena;
-    int narenas;
-    int alloreqs;
-    int freereqs;
-    int alloblks;
-    int freeblks;
-    int uordblks;
-    int fordblks;
+    size_t arena;
+    size_t narenas;
+    size_t alloreqs;
+    size_t freereqs;
+    size_t alloblks;
+    size_t freeblks;
+    size_t uordblks;
+    size_t fordblks;
+    size_t bigblks;
+    size_t bigbytes;
+    size_t cachedbytes;
 } mallinfo_t;
 
+/*
+ * per-CPU shard of the block counters, each on its own cache lines so
+ * that the fast paths of two CPUs never share one
+ * @attri allocs: blocks handed out per size class; index 0 counts spans
+ *                without a class, BIG_BLOCK_CLASS big blocks
+ * @attri frees: blocks given back, same indices
+ */
+typedef struct _stats_shard {
+    size_t allocs[BIG_BLOCK_CLASS + 1];
+    size_t frees[BIG_BLOCK_CLASS + 1];
+} __attribute__((aligned(CACHE_LINE_SIZE))) stats_shard_t;
+
+// count one block of class sc in the shard of the CPU we last ran on;
+// on x86_64 that is one add without lock prefix, which no preemption
+// can split, so only a stale my_cpu on another CPU may lose a count
+#define STATS_SLOT(field, sc) \
+    (&stats_shards[my_cpu & (MAX_SYS_CORE_COUNT - 1)].field[(sc)])
+#if defined(__x86_64__)
+#define STATS_COUNT(field, sc) \
+    __asm__ volatile("addq $1, %0" : "+m"(*STATS_SLOT(field, sc)))
+#else
+#define STATS_COUNT(field, sc) \
+    __atomic_fetch_add(STATS_SLOT(field, sc), 1, __ATOMIC_RELAXED)
+#endif
+
+/*
+ * one telemetry event, as kept per CPU and as returned by the query API
+ * @attri count: number of times it happened
+ * @attri cycles: cycles they took, summed (0 for untimed events)
+ * @attri hist: counts by cycles taken, bucket b holds [2^(b-1), 2^b)
+ */
+typedef struct _telemetry {
+    uint64_t count;
+    uint64_t cycles;
+    uint64_t hist[TELEM_BUCKETS];
+} telemetry_t;
+
+/*
+ * per-CPU shard of the telemetry, on cache lines of its own
+ * @attri events: indexed by TELEM_*
+ */
+typedef struct _telemetry_shard {
+    telemetry_t events[TELEM_EVENTS];
+} __attribute__((aligned(CACHE_LINE_SIZE))) telemetry_shard_t;
+
+// time an operation: TELEM_START() before, TELEM_RECORD(event, start)
+// after; one branch each while telemetry is off
+#define TELEM_START()                            \
+    (__builtin_expect(telemetry_on, 0)           \
+         ? (telemetry_since = telemetry_clock()) \
+         : 0)
+#define TELEM_RECORD(event, start)               \
+    do {                                         \
+        if (__builtin_expect(telemetry_on, 0))   \
+            telemetry_record((event), (start));  \
+    } while (0)
+
+/*
+ * struct for a stack trace of the heap profiler, with what was sampled
+ * at it; the sums are of sampled blocks only, pprof scales them up
+ * @attri hash: of the frames, to find it again
+ * @attri depth: number of frames
+ * @attri frames: return addresses, innermost first
+ * @attri allocs, alloc_bytes: blocks sampled here, and their sizes
+ * @attri frees, free_bytes: those of them freed since
+ * @attri next: next stack trace of the same hash bucket
+ */
+typedef struct _profile_stack {
+    uint64_t hash;
+    int depth;
+    void *frames[PROFILE_DEPTH];
+    size_t allocs;
+    size_t alloc_bytes;
+    size_t frees;
+    size_t free_bytes;
+    struct _profile_stack *next;
+} profile_stack_t;
+
+/*
+ * struct for a sampled block still in use
+ * @attri ptr: the block
+ * @attri size: bytes asked for
+ * @attri size_class: class it came from, 0 for a page sized span,
+ *                    BIG_BLOCK_CLASS for a big block
+ * @attri stack: where it was allocated
+ * @attri next: next sample of the same hash bucket, or free record
+ */
+typedef struct _profile_sample {
+    void *ptr;
+    size_t size;
+    int size_class;
+    profile_stack_t *stack;
+    struct _profile_sample *next;
+} profile_sample_t;
+
 // utilities
 int lg_floor(size_t size);  // only for size < 32 bits
 int size_to_no_blocks(size_t size);
@@ -109,15 +378,121 @@ int initialize_size_classes();
 void create_heap(heap_h_t *hp, int cpu);
 
 // malloc arsenal
-void destory_superblock(superblock_h_t *sbptr);
-superblock_h_t *create_superblock(size_t bk_size, int sc, int pages);
+void *allocate_block(size_t size, int zero);
+int aligned_class(size_t align, size_t size);
+void *aligned_block(size_t align, size_t size);
+void zero_block(void *ptr, size_t len);
+int destory_superblock(superblock_h_t *sbptr);
+int reserve_blocks(superblock_h_t *sbptr, int count);
+void unreserve_blocks(superblock_h_t *sbptr, int count);
+superblock_h_t *create_superblock(size_t bk_size, int sc);
+block_h_t *carve_blocks(superblock_h_t *sbptr, block_h_t **lastp);
 superblock_h_t *retrieve_superblock_from_global_heap(int sc);
+void add_superblock_to_global_heap(superblock_h_t *sbptr);
+void mark_superblock_pending(superblock_h_t *sbptr);
+void sort_pending_superblocks(int sc);
+block_h_t *take_remote_blocks(superblock_h_t *sbptr);
+void reclaim_remote_blocks(superblock_h_t *sbptr);
 block_h_t *search_local_block(int sc);
+int current_cpu_heap();
 block_h_t *restartable_critical_section(int sc);
+int restartable_critical_section_batch(int sc, int max, block_h_t **firstp);
+
+int install_superblock(int sc, superblock_h_t *old_sbptr,
+                       superblock_h_t *new_sbptr);
+
+// arena
+int initialize_arena();
+void *arena_alloc_superblock(int cpu);
+
+// purging
+int initialize_purge();
+uint64_t purge_clock_ms();
+void purge_tick();
+extern int malloc_trim(size_t pad);
+
+// page heap
+void *arena_grow_spans(size_t *len);
+size_t span_pages(size_t size);
+void *span_malloc(size_t pages, int sc, int zero);
+span_t *span_of(void *ptr);
+void span_free(span_t *span);
+int span_resize(span_t *span, size_t pages);
+void span_stats(size_t *in_use, size_t *free_bytes, size_t *free_spans);
+void *span_memalign(size_t pages, size_t align);
+size_t span_trim();
+size_t span_decay(uint64_t decay_ms);
+
+// statistics
+void collect_mallinfo(mallinfo_t *mi);
+
+// telemetry
+int initialize_telemetry();
+uint64_t telemetry_clock();
+void telemetry_record(int event, uint64_t start);
+void telemetry_lock(pthread_mutex_t *lock);
+int speedyloc_telemetry(int event, telemetry_t *out);
+const char *speedyloc_telemetry_name(int event);
+void speedyloc_telemetry_dump(int fd);
+
+// heap profiler
+int initialize_profile();
+void profile_malloc(void *ptr, size_t size);
+void profile_free(void *ptr);
+profile_sample_t *profile_take(void *ptr);
+void profile_put(profile_sample_t *sample, void *ptr);
+int speedyloc_profile_dump(const char *path);
+
+// big block cache
+size_t big_block_length(size_t size);
+big_block_h_t *big_cache_get(size_t len);
+int big_cache_put(big_block_h_t *big);
+size_t big_cache_size();
+size_t big_cache_flush();
+size_t big_cache_decay(uint64_t decay_ms);
+
+// page map
+int pagemap_set(void *addr, size_t len, void *owner);
+void *pagemap_get(void *addr);
 
 // free arsenal
 superblock_h_t *retrieve_mamablock(block_h_t *bptr);
-int restartable_critical_section_free(superblock_h_t *mama_s, block_h_t *bptr);
+void add_block_to_remote(superblock_h_t *mama_s, block_h_t *first,
+                         block_h_t *last, int count);
+void settle_superblock_fill(superblock_h_t *mama_s, int in_use, int moved);
+int restartable_critical_section_free(superblock_h_t *mama_s, block_h_t *first,
+                                      block_h_t *last, int count);
+void release_blocks(superblock_h_t *mama_s, block_h_t *first, block_h_t *last,
+                    int count);
+
+// thread cache
+int initialize_thread_cache();
+void thread_cache_flush(int sc, int count);
+void thread_cache_destroy(void *arg);
+void *thread_cache_malloc(int sc);
+int thread_cache_free(superblock_h_t *mama_s, block_h_t *bptr);
+
+// engine picked at load time, "signal", "rseq" or "cas"
+const char *speedyloc_engine();
+
+// rseq engine
+int rseq_available();
+block_h_t *rseq_critical_section(int sc);
+int rseq_critical_section_batch(int sc, int max, block_h_t **firstp);
+int rseq_critical_section_free(superblock_h_t *mama_s, block_h_t *first,
+                               block_h_t *last, int count);
+int rseq_install_superblock(int cpu, int sc, superblock_h_t *old_sbptr,
+                            superblock_h_t *new_sbptr);
+
+// cas engine
+block_h_t *cas_critical_section(int sc);
+int cas_critical_section_batch(int sc, int max, block_h_t **firstp);
+int cas_critical_section_free(superblock_h_t *mama_s, block_h_t *first,
+                              block_h_t *last, int count);
+int cas_install_superblock(int cpu, int sc, superblock_h_t *old_sbptr,
+                           superblock_h_t *new_sbptr);
+void cas_push_local_chain(superblock_h_t *sbptr, block_h_t *first,
+                          block_h_t *last);
 
 // TODO: clean me
 // typedef void *(*__malloc_hook_t)(size_t size, const void *caller);
@@ -127,17 +502,26 @@ int restartable_critical_section_free(superblock_h_t *mama_s, block_h_t *bptr);
 // void *caller);
 
 void *__lib_malloc(size_t size);    // le alias
+void *__lib_realloc(void *ptr, size_t size);  // le alias
+void *__lib_calloc(size_t nmemb, size_t size);  // le alias
+void *__lib_memalign(size_t align, size_t size);  // le alias
+void __lib_free_sized(void *mem, size_t size);  // le alias
+void __lib_free_aligned_sized(void *mem, size_t align, size_t size);
+size_t __lib_malloc_usable_size(void *mem);  // le alias
 extern void __lib_free(void *mem);  // le alias
 extern void *malloc(size_t size);
 extern void free(void *mem_ptr);
-// extern void *calloc(size_t nmemb, size_t size);
-// extern void *realloc(void *ptr, size_t size);
+extern void *calloc(size_t nmemb, size_t size);
+extern void *realloc(void *ptr, size_t size);
 
 extern long sys_page_size;
 extern int sys_page_shift;
 extern int sys_core_count;
+extern int sys_core_exact;
 extern int malloc_initialized;
+extern int malloc_engine;
 extern int num_size_classes;
+extern int num_span_classes;
 extern __thread int restartable;
 extern __thread int my_cpu;
 extern __thread jmp_buf critical_section_malloc;
@@ -145,6 +529,23 @@ extern __thread jmp_buf critical_section_free;
 extern char class_array_[FLAT_CLASS_NO];
 extern size_t class_to_size_[MAX_BINS];
 extern size_t class_to_pages_[MAX_BINS];
-extern heap_h_t cpu_heaps[MAX_SYS_CORE_COUNT + 1];
+extern size_t class_to_align_[MAX_BINS];
+extern heap_h_t *cpu_heaps;
+extern global_heap_h_t global_heap;
+extern void *sb_region_lo;
+extern void *sb_region_hi;
+extern void *span_region_lo;
+extern void *span_region_hi;
+extern pthread_mutex_t global_heap_lock[MAX_BINS];
+extern int arena_thp;
+extern size_t arena_committed;
+extern size_t stats_big_bytes;
+extern stats_shard_t stats_shards[MAX_SYS_CORE_COUNT];
+extern int telemetry_on;
+extern __thread uint64_t telemetry_since;
+extern size_t profile_rate;
+extern size_t arena_chunk_size;
+extern int purge_decay_ms;
+extern int purge_advice;
 
 #endif
\ No newline at end of file
@@ -13,49 +13,47 @@
 #include <unistd.h>
 #include "common.h"
 
+__thread int purge_countdown = PURGE_TICK_FREES;
+
 /*
  * validate that block is within heap's terrain, returns null if invalid
- * return the pointer to the superblock where this block was given birth
+ * return the pointer to the superblock where this block was given birth;
+ * superblocks are SB_SIZE aligned, so that is a mask of the address
  */
 superblock_h_t *retrieve_mamablock(block_h_t *bptr)
 {
-    size_t sc = bptr->size_class;
-    size_t pages = class_to_pages_[sc];
-    int psize = (int)pages * sys_page_size, i;
-    superblock_h_t *itr = NULL;
-    for (i = 0; i <= sys_core_count; i++) {
-        itr = cpu_heaps[i].bins[sc];
-        superblock_h_t *prev_itr = itr;
-        while (itr != NULL && ((char *)itr >= (char *)bptr ||
-                               (char *)itr + psize <= (char *)bptr)) {
-            prev_itr = itr;
-            itr = itr->next;
-        }
-        if (itr != NULL) {
-            break;
-        }
-    }
-    return itr;
+    if ((void *)bptr < sb_region_lo || (void *)bptr >= sb_region_hi)
+        return NULL;
+    return SUPERBLOCK_OF(bptr);
 }
 
 /*
+ * frees the chain first->...->last of $count blocks born in mama_s;
  * returns 0 if slow path is taken;
  * returns 1 if fast path is taken;
  */
-int restartable_critical_section_free(superblock_h_t *mama_s, block_h_t *bptr)
+int restartable_critical_section_free(superblock_h_t *mama_s, block_h_t *first,
+                                      block_h_t *last, int count)
 {
+#ifdef USE_RSEQ
+    if (malloc_engine == ENGINE_RSEQ)
+        return rseq_critical_section_free(mama_s, first, last, count);
+#endif
+    if (malloc_engine == ENGINE_CAS)
+        return cas_critical_section_free(mama_s, first, last, count);
+
     restartable = 2;
     int path = 0;
-    size_t sc = bptr->size_class;
+    size_t sc = mama_s->size_class;
 
     // get current CPU id
-    my_cpu = sched_getcpu();
+    my_cpu = current_cpu_heap();
     if (my_cpu < 0) {
         restartable = 0;
         return path;
     }
 
-    // check if mama_s (further implies bptr's locality) is local
+    // check if mama_s (further implies the blocks' locality) is local
     heap_h_t hp = cpu_heaps[my_cpu];
     superblock_h_t *local_sbptr = hp.bins[sc];
     if (local_sbptr == NULL || ((char *)local_sbptr - (char *)mama_s) != 0) {
@@ -63,27 +61,117 @@ int restartable_critical_section_free(superblock_h_t *mama_s, block_h_t *bptr)
         return path;
     }
 
-    // bptr is local, link it to local_head
-    bptr->next = (block_h_t *)local_sbptr->local_head;
-    local_sbptr->local_head = (void *)bptr;
+    // chain is local, link it to local_head
+    last->next = (block_h_t *)TAGGED_PTR(local_sbptr->local_head);
+    local_sbptr->local_head = (void *)first;
 
     // update flag and stats
-    local_sbptr->in_use_count--;
+    __atomic_fetch_sub(&local_sbptr->in_use_count, count, __ATOMIC_RELAXED);
     restartable = 0;
     path = 1;
     return path;
 }
 
 /*
- * lock mama superblock;
- * push to-be-freed block to the remote free list of its mama superblock
+ * push the to-be-freed chain of $count blocks onto the remote free list of
+ * its mama superblock with one CAS, no lock; the pushed head records the
+ * tail of the whole list so that the owner can splice it in O(1)
+ */
+void add_block_to_remote(superblock_h_t *mama_s, block_h_t *first,
+                         block_h_t *last, int count)
+{
+    void *old = __atomic_load_n(&mama_s->remote_head, __ATOMIC_ACQUIRE);
+    int tries = 0;
+    do {
+        // contended: another free or the owner got in between
+        if (tries++ != 0) TELEM_RECORD(TELEM_REMOTE_RETRY, telemetry_since);
+        block_h_t *top = (block_h_t *)TAGGED_PTR(old);
+        last->next = top;
+        // top->tail is stale if the list was taken meanwhile, but then
+        // the tag has moved on and the CAS below fails
+        first->tail = top != NULL ? top->tail : last;
+    } while (!__atomic_compare_exchange_n(&mama_s->remote_head, &old,
+                                          TAG_SUCCESSOR(old, first), true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    // uncounted only once pushed, as the local frees do: a superblock
+    // with nothing in use has no free still on its way, which
+    // destory_superblock() relies on
+    int in_use = __atomic_sub_fetch(&mama_s->in_use_count, count,
+                                    __ATOMIC_ACQ_REL);
+    settle_superblock_fill(mama_s, in_use, TAGGED_PTR(old) == NULL);
+}
+
+/*
+ * after blocks of mama_s were freed outside of the critical sections,
+ * leaving $in_use blocks in use: the global heap keeps its superblocks
+ * sorted by fill, so queue it for sorting if it emptied or $moved says
+ * its list may be wrong otherwise
+ */
+void settle_superblock_fill(superblock_h_t *mama_s, int in_use, int moved)
+{
+    if (in_use == 0)
+        __atomic_store_n(&mama_s->empty_since, purge_clock_ms(),
+                         __ATOMIC_RELAXED);
+    if (moved || in_use == 0) mark_superblock_pending(mama_s);
+    // an empty superblock may be due for purging
+    if (in_use == 0) purge_tick();
+}
+
+/*
+ * give the chain first->...->last of $count blocks back to mama_s:
+ * to its local list if it is the current CPU's, else to its remote one
  */
-void add_block_to_remote(superblock_h_t *mama_s, block_h_t *bptr)
+void release_blocks(superblock_h_t *mama_s, block_h_t *first, block_h_t *last,
+                    int count)
 {
-    pthread_mutex_lock(&mama_s->lock);
-    bptr->next = (block_h_t *)mama_s->remote_head;
-    mama_s->remote_head = (void *)bptr;
-    pthread_mutex_unlock(&mama_s->lock);
+    // FAST PATH: hit restartable critical section and return immediately
+    uint64_t start = TELEM_START();
+    if (malloc_engine == ENGINE_SIGNAL) setjmp(critical_section_free);
+    int slow_path = restartable_critical_section_free(mama_s, first, last, count);
+    if (slow_path != 0) {
+        // no count: a refill of the local list, not a free
+        if (count != 0) TELEM_RECORD(TELEM_FAST_FREE, start);
+        return;
+    }
+
+    // SLOW PATH: add the chain to mama_s's 'remote' free list
+    add_block_to_remote(mama_s, first, last, count);
+    TELEM_RECORD(TELEM_REMOTE_FREE, start);
+}
+
+/*
+ * give a small block back to mama_s, through the thread cache if any
+ */
+static void free_small_block(superblock_h_t *mama_s, block_h_t *bptr)
+{
+    STATS_COUNT(frees, mama_s->size_class);
+#ifdef USE_THREAD_CACHE
+    if (thread_cache_free(mama_s, bptr)) return;
+#endif
+    release_blocks(mama_s, bptr, bptr, 1);
+
+    // every PURGE_TICK_FREES frees, see if empty superblocks are due
+    if (--purge_countdown <= 0) {
+        purge_countdown = PURGE_TICK_FREES;
+        purge_tick();
+    }
+}
+
+/*
+ * unregister a big block; keep it for reuse, or unmmap it; then see if
+ * cached ones are due for unmapping
+ */
+static void free_big_block(big_block_h_t *big)
+{
+    STATS_COUNT(frees, BIG_BLOCK_CLASS);
+    __atomic_fetch_sub(&stats_big_bytes, big->length, __ATOMIC_RELAXED);
+    pagemap_set(big + 1, 1, NULL);
+    if (!big_cache_put(big)) {
+        int res = munmap((void *)big, big->length);
+        assert(res == 0);
+    }
+    purge_tick();
 }
 
 /*
@@ -99,38 +187,84 @@ void __lib_free(void *mem_ptr)
     }
 
     if (mem_ptr == NULL) return;
+    if (__builtin_expect(profile_rate != 0, 0)) profile_free(mem_ptr);
     superblock_h_t *mama_s;
-    block_h_t *bptr = (block_h_t *)((char *)mem_ptr - sizeof(block_h_t));
-    uint8_t sc = bptr->size_class;
-
-    // destory and return immediately if large
-    if (sc > MAX_BINS) {
-        // destory the block, unmmap it
-        size_t size = class_to_size_[sc];
-        int res = munmap((void *)bptr, size);
-        assert(res == 0);
-        return;
-    }
+    block_h_t *bptr = (block_h_t *)mem_ptr;
 
-    // validate & retrieve superblock
+    // validate & retrieve superblock; outside superblocks, only spans
+    // and big blocks registered in the page map are ours
     if ((mama_s = retrieve_mamablock(bptr)) == NULL) {
+        if (mem_ptr >= span_region_lo && mem_ptr < span_region_hi) {
+            span_t *span = span_of(mem_ptr);
+            if (span != NULL) span_free(span);
+            return;
+        }
+        big_block_h_t *big = (big_block_h_t *)pagemap_get(mem_ptr);
+        if (big != NULL && big + 1 == mem_ptr) free_big_block(big);
         return;
     }
 
-    // FAST PATH: hit restartable critical section and return immediately
-    int r = setjmp(critical_section_free);
-    int slow_path = restartable_critical_section_free(mama_s, bptr);
-    if (slow_path != 0) {
-        return;
-    }
+    free_small_block(mama_s, bptr);
+    return;
+}
+void free(void *mem_ptr) __attribute__((weak, alias("__lib_free")));
 
-    // SLOW PATH: lock mama_s, add bptr to its 'remote' free list
-    add_block_to_remote(mama_s, bptr);
+/*
+ * C23 free with the size the block was allocated (or last reallocated)
+ * with: a block of at most MAX_LRG_SIZE bytes is a small one, one of
+ * more than MAX_SPAN_SIZE a big one right behind its header, so neither
+ * needs the range checks nor the page map; spans (and big blocks shrunk
+ * in place below MAX_SPAN_SIZE) take the usual way
+ */
+void __lib_free_sized(void *mem_ptr, size_t size)
+{
+    if (mem_ptr == NULL) return;
+    if (size <= MAX_LRG_SIZE) {
+        if (__builtin_expect(profile_rate != 0, 0)) profile_free(mem_ptr);
+        free_small_block(SUPERBLOCK_OF(mem_ptr), (block_h_t *)mem_ptr);
+    } else if (size > MAX_SPAN_SIZE) {
+        if (__builtin_expect(profile_rate != 0, 0)) profile_free(mem_ptr);
+        free_big_block((big_block_h_t *)mem_ptr - 1);
+    } else {
+        __lib_free(mem_ptr);
+    }
+}
+void free_sized(void *mem_ptr, size_t size)
+    __attribute__((weak, alias("__lib_free_sized")));
 
-    // TODO: destory mama_s,
-    // when: mama_s->in_use_count = 0, and global_heap has too many
-    // completely free superblocks (whose in_use_count = 0)
+/*
+ * C23 free of a block from aligned_alloc(): the class it came from
+ * follows from $align and $size, like in aligned_alloc()
+ */
+void __lib_free_aligned_sized(void *mem_ptr, size_t align, size_t size)
+{
+    if (mem_ptr == NULL) return;
+    if (align <= REAL_SML_ALIGN) {
+        __lib_free_sized(mem_ptr, size);
+    } else if (aligned_class(align, size) >= 0) {
+        if (__builtin_expect(profile_rate != 0, 0)) profile_free(mem_ptr);
+        free_small_block(SUPERBLOCK_OF(mem_ptr), (block_h_t *)mem_ptr);
+    } else {
+        __lib_free(mem_ptr);
+    }
+}
+void free_aligned_sized(void *mem_ptr, size_t align, size_t size)
+    __attribute__((weak, alias("__lib_free_aligned_sized")));
 
-    return;
+/*
+ * bytes usable in the block at mem_ptr, 0 if it is not one of ours
+ */
+size_t __lib_malloc_usable_size(void *mem_ptr)
+{
+    if (mem_ptr == NULL) return 0;
+    superblock_h_t *mama_s = retrieve_mamablock(mem_ptr);
+    if (mama_s != NULL) return class_to_size_[mama_s->size_class];
+    span_t *span = span_of(mem_ptr);
+    if (span != NULL) return span->pages << SPAN_PAGE_SHIFT;
+    big_block_h_t *big = (big_block_h_t *)pagemap_get(mem_ptr);
+    if (big != NULL && big + 1 == mem_ptr)
+        return big->length - sizeof(big_block_h_t);
+    return 0;
 }
-void free(void *mem_ptr) __attribute__((weak, alias("__lib_free")));
+size_t malloc_usable_size(void *mem_ptr)
+    __attribute__((weak, alias("__lib_malloc_usable_size")));
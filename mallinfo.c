@@ -0,0 +1,160 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <malloc.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Allocation statistics.
+ *
+ * The fast paths count blocks in the stats shard of the CPU they last
+ * ran on, with unlocked adds on lines no other CPU writes to in the
+ * common case (see STATS_COUNT); spans are counted under span_lock, big blocks and
+ * committed arena bytes with plain atomic adds on their (slow) paths.
+ * Nothing is summed until mallinfo(), mallinfo2() or malloc_stats()
+ * asks, so the figures are a snapshot that may be off by the operations
+ * in flight.
+ */
+
+stats_shard_t stats_shards[MAX_SYS_CORE_COUNT];
+size_t stats_big_bytes = 0;  // mapped length of the big blocks in use
+
+/*
+ * sum the shards for class $sc
+ */
+static void class_counts(int sc, size_t *allocs, size_t *frees)
+{
+    int cpu;
+    *allocs = *frees = 0;
+    for (cpu = 0; cpu < MAX_SYS_CORE_COUNT; cpu++) {
+        *allocs += __atomic_load_n(&stats_shards[cpu].allocs[sc],
+                                   __ATOMIC_RELAXED);
+        *frees += __atomic_load_n(&stats_shards[cpu].frees[sc],
+                                  __ATOMIC_RELAXED);
+    }
+}
+
+/*
+ * fill $mi with the current totals
+ */
+void collect_mallinfo(mallinfo_t *mi)
+{
+    size_t span_used, span_free, span_count;
+    span_stats(&span_used, &span_free, &span_count);
+
+    memset(mi, 0, sizeof(*mi));
+    int sc;
+    for (sc = 0; sc <= BIG_BLOCK_CLASS; sc++) {
+        size_t allocs, frees;
+        class_counts(sc, &allocs, &frees);
+        mi->alloreqs += allocs;
+        mi->freereqs += frees;
+        // a block freed on another CPU may be counted before its alloc
+        size_t used = allocs > frees ? allocs - frees : 0;
+        mi->alloblks += used;
+        if (sc == BIG_BLOCK_CLASS) mi->bigblks = used;
+        if (sc > 0 && sc < num_size_classes)
+            mi->uordblks += used * class_to_size_[sc];
+    }
+    mi->uordblks += span_used;
+    mi->bigbytes = __atomic_load_n(&stats_big_bytes, __ATOMIC_RELAXED);
+    mi->cachedbytes = big_cache_size();
+    mi->freeblks = span_count;
+    mi->narenas = sys_core_count;
+    mi->arena = __atomic_load_n(&arena_committed, __ATOMIC_RELAXED);
+    mi->fordblks = mi->arena > mi->uordblks ? mi->arena - mi->uordblks : 0;
+}
+
+/*
+ * glibc layout: arena holds the superblocks and spans, hblks/hblkhd the
+ * big blocks in use, keepcost what malloc_trim() could give back
+ */
+struct mallinfo2 __lib_mallinfo2()
+{
+    struct mallinfo2 out;
+    mallinfo_t mi;
+    memset(&out, 0, sizeof(out));
+    if (initialize_malloc() != SUCCESS) return out;
+    collect_mallinfo(&mi);
+    out.arena = mi.arena;
+    out.ordblks = mi.freeblks;
+    out.hblks = mi.bigblks;
+    out.hblkhd = mi.bigbytes;
+    out.uordblks = mi.uordblks;
+    out.fordblks = mi.fordblks;
+    out.keepcost = mi.cachedbytes;
+    return out;
+}
+
+/*
+ * same as mallinfo2(), each field clamped to INT_MAX
+ */
+struct mallinfo __lib_mallinfo()
+{
+    struct mallinfo2 in = __lib_mallinfo2();
+    struct mallinfo out;
+#define CLAMP(f) out.f = in.f > INT_MAX ? INT_MAX : (int)in.f
+    CLAMP(arena);
+    CLAMP(ordblks);
+    CLAMP(smblks);
+    CLAMP(hblks);
+    CLAMP(hblkhd);
+    CLAMP(usmblks);
+    CLAMP(fsmblks);
+    CLAMP(uordblks);
+    CLAMP(fordblks);
+    CLAMP(keepcost);
+#undef CLAMP
+    return out;
+}
+
+/*
+ * print the totals and the per size class breakdown to stderr
+ */
+void __lib_malloc_stats()
+{
+    if (initialize_malloc() != SUCCESS) return;
+    mallinfo_t mi;
+    collect_mallinfo(&mi);
+
+    fprintf(stderr, "heaps:           %10zu\n", mi.narenas);
+    fprintf(stderr, "arena bytes:     %10zu\n", mi.arena);
+    fprintf(stderr, "in use bytes:    %10zu\n", mi.uordblks);
+    fprintf(stderr, "free bytes:      %10zu\n", mi.fordblks);
+    fprintf(stderr, "free spans:      %10zu\n", mi.freeblks);
+    fprintf(stderr, "big blocks:      %10zu (%zu bytes)\n", mi.bigblks,
+            mi.bigbytes);
+    fprintf(stderr, "big cache bytes: %10zu\n", mi.cachedbytes);
+    fprintf(stderr, "requests:        %10zu allocs %10zu frees\n",
+            mi.alloreqs, mi.freereqs);
+
+    fprintf(stderr, "%5s %8s %12s %12s %12s %14s\n", "class", "size",
+            "allocs", "frees", "in use", "in use bytes");
+    int sc;
+    for (sc = 0; sc <= BIG_BLOCK_CLASS; sc++) {
+        size_t allocs, frees;
+        class_counts(sc, &allocs, &frees);
+        if (allocs == 0) continue;
+        size_t used = allocs > frees ? allocs - frees : 0;
+        if (sc == 0 || sc == BIG_BLOCK_CLASS) {
+            // no fixed size: spans by the page, big blocks mmapped
+            fprintf(stderr, "%5s %8s %12zu %12zu %12zu %14s\n",
+                    sc == 0 ? "span" : "big", "-", allocs, frees, used, "-");
+        } else {
+            fprintf(stderr, "%5d %8zu %12zu %12zu %12zu %14zu\n", sc,
+                    class_to_size_[sc], allocs, frees, used,
+                    used * class_to_size_[sc]);
+        }
+    }
+}
+
+struct mallinfo2 mallinfo2()
+    __attribute__((weak, alias("__lib_mallinfo2")));
+struct mallinfo mallinfo() __attribute__((weak, alias("__lib_mallinfo")));
+void malloc_stats() __attribute__((weak, alias("__lib_malloc_stats")));
@@ -27,12 +27,18 @@ struct sigaction sig;
 long sys_page_size = SYS_PAGE_SIZE;
 int sys_page_shift = 16;
 int sys_core_count = MAX_SYS_CORE_COUNT;
+int sys_core_exact = 0;  // sys_core_count bounds every CPU id
 int malloc_initialized = 0;
-int num_size_classes;
+int malloc_engine = ENGINE_CAS;  // until myconstructor() picks one
+int num_size_classes;  // superblock classes are [1, num_size_classes)
+int num_span_classes;  // span classes follow them
 char class_array_[FLAT_CLASS_NO];
 size_t class_to_size_[MAX_BINS];
 size_t class_to_pages_[MAX_BINS];
-heap_h_t cpu_heaps[MAX_SYS_CORE_COUNT + 1];
+size_t class_to_align_[MAX_BINS];  // every block of the class is aligned to
+heap_h_t *cpu_heaps = NULL;  // sys_core_count of them
+global_heap_h_t global_heap;
+pthread_mutex_t global_heap_lock[MAX_BINS];
 
 // per thread global
 __thread int restartable = 0;
@@ -47,11 +53,14 @@ else it resumes the execution.
 */
 void upcall_handler()
 {
+    TELEM_RECORD(TELEM_UPCALL, 0);
     switch (restartable) {
         case 1:
+            TELEM_RECORD(TELEM_RESTART, telemetry_since);
             longjmp(critical_section_malloc, 1);
             break;
         case 2:
+            TELEM_RECORD(TELEM_RESTART, telemetry_since);
             longjmp(critical_section_free, 1);
             break;
         default:
@@ -61,22 +70,24 @@ void upcall_handler()
 
 /*
     Registers the process with the driver
+    returns FAILURE if the driver is not loaded
 */
-void register_to_driver()
+int register_to_driver()
 {
     char *file_name = "/dev/query";
     int fd;
     fd = open(file_name, O_RDWR);
     if (fd == -1) {
-        perror("Could not open device file");
-        exit(1);
+        return FAILURE;
     }
-    int v;
     registered_proc_t q;
     q.pid = getpid();
     if (ioctl(fd, _SET_PROC_META, &q) == -1) {
         perror("query ioctl set");
+        close(fd);
+        return FAILURE;
     }
+    return SUCCESS;
 }
 
 /*
@@ -92,12 +103,42 @@ void attach_upcall_signal()
 /*
 Global constructor gets called one time when the malloc
 library gets loaded in the process environment.
+Picks the engine: rseq if built in, else the upcall driver,
+else compare-and-swap. SPEEDYLOC_ENGINE=cas forces the latter, and so
+does a CPU count that could not be read off sysfs.
 */
 __attribute__((constructor)) void myconstructor()
 {
     initialize_malloc();
+    char *forced = getenv("SPEEDYLOC_ENGINE");
+    // rseq and the upcalls need a heap of its own for every CPU id
+    if ((forced != NULL && strcmp(forced, "cas") == 0) || !sys_core_exact) {
+        malloc_engine = ENGINE_CAS;
+        return;
+    }
+#ifdef USE_RSEQ
+    // no upcalls needed if the kernel restarts the sections for us
+    if (rseq_available()) {
+        malloc_engine = ENGINE_RSEQ;
+        return;
+    }
+#endif
     attach_upcall_signal();
-    register_to_driver();
+    if (register_to_driver() == SUCCESS) {
+        malloc_engine = ENGINE_SIGNAL;
+    } else {
+        malloc_engine = ENGINE_CAS;
+    }
+}
+
+/*
+ * query API: name of the engine myconstructor() picked, so that a
+ * benchmark can tell a fallback to cas from the engine it asked for
+ */
+const char *speedyloc_engine()
+{
+    static const char *names[] = {"signal", "rseq", "cas"};
+    return names[malloc_engine];
 }
 
 // Sizes <= 1024 have an alignment >= 8.  So for such sizes we have an
@@ -119,7 +160,7 @@ __attribute__((constructor)) void myconstructor()
 //   32768      (32768 + 127 + (120<<7)) / 128  376
 int class_index(size_t size)
 {
-    if (size > MAX_LRG_SIZE) return -1;
+    if (size > MAX_SPAN_CLASS_SIZE) return -1;
     if (size > MAX_SML_SIZE) return LRG_SIZE_CLASS_IDX(size);
     return SML_SIZE_CLASS_IDX(size);
 }
@@ -172,7 +213,10 @@ int size_to_alignment(size_t size)
     return alignment;
 }
 
-// initialize class_array_, class_to_size_, and class_to_pages_
+static size_t superblock_head_offset(size_t bk_size);
+
+// initialize class_array_, class_to_size_, class_to_pages_
+// and class_to_align_
 int initialize_size_classes()
 {
     // Compute the size classes we want to use
@@ -216,11 +260,33 @@ int initialize_size_classes()
         sc++;
     }
 
-    // mapping arrays
-    int next_size = 0;
     num_size_classes = sc;
+
+    // span classes, one per page count up to MAX_SPAN_CLASS_SIZE;
+    // their blocks are whole spans of the page heap
+    for (size = 2 * SPAN_PAGE_SIZE; size <= MAX_SPAN_CLASS_SIZE;
+         size += SPAN_PAGE_SIZE) {
+        class_to_pages_[sc] = size >> SPAN_PAGE_SHIFT;
+        class_to_size_[sc] = size;
+        sc++;
+    }
+    num_span_classes = sc - num_size_classes;
+
+    // blocks sit at head offset + i * size from an SB_SIZE boundary,
+    // spans on page boundaries
     int c;
-    for (c = 1; c < num_size_classes; c++) {
+    for (c = 1; c < sc; c++) {
+        size_t bits = class_to_size_[c];
+        if (c < num_size_classes)
+            bits |= superblock_head_offset(class_to_size_[c]);
+        class_to_align_[c] = bits & -bits;
+        if (class_to_align_[c] > SPAN_PAGE_SIZE)
+            class_to_align_[c] = SPAN_PAGE_SIZE;
+    }
+
+    // mapping arrays
+    int next_size = 0;
+    for (c = 1; c < num_size_classes + num_span_classes; c++) {
         int max_size_in_class = class_to_size_[c];
         int s;
         for (s = next_size; s <= max_size_in_class; s += SML_ALIGN) {
@@ -232,6 +298,34 @@ int initialize_size_classes()
     return SUCCESS;
 }
 
+/*
+ * highest possible CPU id plus one, as /sys/devices/system/cpu/possible
+ * lists them (e.g. "0-95" or "0,2-5"); sched_getcpu() and rseq never
+ * return an id past it, online or not; returns 0 if it cannot be read
+ */
+static int possible_cpu_count()
+{
+    char buf[256];
+    int fd = open("/sys/devices/system/cpu/possible", O_RDONLY | O_CLOEXEC);
+    if (fd == -1) return 0;
+    ssize_t len = read(fd, buf, sizeof(buf));
+    close(fd);
+
+    // the last number is the highest id
+    int last = -1, cur = -1;
+    ssize_t i;
+    for (i = 0; i < len; i++) {
+        if (buf[i] >= '0' && buf[i] <= '9') {
+            cur = (cur < 0 ? 0 : cur * 10) + (buf[i] - '0');
+        } else if (cur >= 0) {
+            last = cur;
+            cur = -1;
+        }
+    }
+    if (cur >= 0) last = cur;
+    return last + 1;
+}
+
 /*
  * confirm sys_page_size and sys_core_count;
  * initialize HEAP per CPU core, plus global HEAP;
@@ -247,8 +341,10 @@ int initialize_malloc()
         sys_page_size = SYS_PAGE_SIZE;
     sys_page_shift = (int)(log(sys_page_size) / log(2));
 
-    // confirm number of cores
-    if ((sys_core_count = sysconf(_SC_NPROCESSORS_ONLN)) == -1)
+    // confirm number of cores: CPU ids are not bound by the online count
+    if ((sys_core_count = possible_cpu_count()) > 0)
+        sys_core_exact = 1;
+    else if ((sys_core_count = sysconf(_SC_NPROCESSORS_CONF)) <= 0)
         sys_core_count = MAX_SYS_CORE_COUNT;
 
     // ini size class mappings
@@ -257,110 +353,377 @@ int initialize_malloc()
         return out;
     }
 
+    // read the purge settings
+    if ((out = initialize_purge()) == FAILURE) {
+        errno = ENOMEM;
+        return out;
+    }
+
+    // read the telemetry setting
+    if ((out = initialize_telemetry()) == FAILURE) {
+        errno = ENOMEM;
+        return out;
+    }
+
+    // read the profiler settings
+    if ((out = initialize_profile()) == FAILURE) {
+        errno = ENOMEM;
+        return out;
+    }
+
+    // reserve the arena superblocks are carved from
+    if ((out = initialize_arena()) == FAILURE) {
+        errno = ENOMEM;
+        return out;
+    }
+
     // ini arena meta data
     if ((out = initialize_heaps()) == FAILURE) {
         errno = ENOMEM;
         return out;
     }
 
+#ifdef USE_THREAD_CACHE
+    if ((out = initialize_thread_cache()) == FAILURE) {
+        errno = ENOMEM;
+        return out;
+    }
+#endif
+
     // raise flag & set stats
     malloc_initialized = 1;
     return out;
 }
 
 /*
- * create a global heap, one heap per core;
- * add a super block per (heap, size class);
- * break super block to free blocks;
+ * ini the global heap locks and one empty heap per core, mmapped as
+ * their number is only known now;
+ * superblocks are created on first use of each (heap, size class)
  */
 int initialize_heaps()
 {
-    int i;  // when i = sysc_core_count, the heap is global
-    for (i = 0; i <= sys_core_count; i++) {
+    int i;
+    for (i = 0; i < MAX_BINS; i++) {
+        if (pthread_mutex_init(&global_heap_lock[i], NULL) != 0)
+            return FAILURE;
+    }
+    void *heaps = mmap(NULL, (size_t)sys_core_count * sizeof(heap_h_t),
+                       PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+                       -1, 0);
+    if (heaps == MAP_FAILED) return FAILURE;
+    cpu_heaps = heaps;
+    for (i = 0; i < sys_core_count; i++) {
         create_heap(&cpu_heaps[i], i);
     }
+    return SUCCESS;
 }
 
 /*
  * create a heap for a particular core;
- * initiates the superblocks for each size class;
+ * its bins stay empty until the slow path installs a superblock
  */
 void create_heap(heap_h_t *hp, int cpu)
 {
     hp->cpu = cpu;
+    hp->chunk = NULL;
     int i;
-    for (i = 1; i < num_size_classes; i++) {
-        int sc = i;
-        size_t pages = class_to_pages_[sc];
-        size_t bk_size = class_to_size_[sc];
-        hp->bins[i] = create_superblock(bk_size, sc, pages);
+    for (i = 0; i < MAX_BINS; i++) {
+        hp->bins[i] = NULL;
     }
     return;
 }
 
+/*
+ * offset of the first block of a superblock of bk_size blocks;
+ * blocks have no header, so the first one must start aligned,
+ * and not on the header's cache lines
+ */
+static size_t superblock_head_offset(size_t bk_size)
+{
+    size_t alignment = size_to_alignment(bk_size);
+    if (alignment < CACHE_LINE_SIZE) alignment = CACHE_LINE_SIZE;
+    return (sizeof(superblock_h_t) + alignment - 1) & ~(alignment - 1);
+}
+
+/*
+ * end of the last block that fits in sbptr
+ */
+static char *superblock_end(superblock_h_t *sbptr)
+{
+    size_t bk_size = class_to_size_[sbptr->size_class];
+    size_t head_offset = superblock_head_offset(bk_size);
+    return (char *)sbptr + head_offset +
+           (SB_SIZE - head_offset) / bk_size * bk_size;
+}
+
 /*
  * create a superblock for a given size class;
- * allocate $pages number of pages;
- * create linked list of blocks;
+ * allocate one SB_SIZE aligned region, header included, so that any
+ * block finds its superblock with SUPERBLOCK_OF();
+ * blocks are carved later off its bump pointer, so only the header
+ * page is touched here
  */
-superblock_h_t *create_superblock(size_t bk_size, int sc, int pages)
+superblock_h_t *create_superblock(size_t bk_size, int sc)
 {
-    // allocate pages to fill the superblock, with some wasted spaces
-    int size_to_allocate = sys_page_size * pages + sizeof(superblock_h_t);
-    int blocks_to_add = (sys_page_size * pages) / (int)bk_size;
-    superblock_h_t *sbptr;
-    if ((sbptr = (superblock_h_t *)sbrk(size_to_allocate)) == NULL) return NULL;
+    size_t head_offset = superblock_head_offset(bk_size);
+    superblock_h_t *sbptr = arena_alloc_superblock(my_cpu);
+    if (sbptr == NULL) return NULL;
 
     // ini the superblock
-    void *head_addr = (void *)((char *)sbptr + sizeof(superblock_h_t));
+    sbptr->size_class = sc;
+    sbptr->list = SB_DETACHED;
+    sbptr->pending = 0;
+    sbptr->clean = 1;
     sbptr->in_use_count = 0;
-    sbptr->local_head = head_addr;
+    sbptr->local_head = NULL;
     sbptr->remote_head = NULL;
     sbptr->next = NULL;
-    if (pthread_mutex_init(&sbptr->lock, NULL) != 0) {
-        return NULL;
-    }
+    sbptr->prev = NULL;
+    sbptr->pending_next = NULL;
+    sbptr->bump = (char *)sbptr + head_offset;
+    sbptr->empty_since = 0;
+    return sbptr;
+}
 
-    // create a linked list of blocks
-    void *itr = head_addr;
-    block_h_t *prev = NULL;
-    while (itr < (head_addr + blocks_to_add * bk_size)) {
-        // create cur
-        block_h_t *cur = (block_h_t *)itr;
-        cur->size_class = sc;
-        cur->next = NULL;
-        // link prev
-        if (prev != NULL) prev->next = cur;
-        // swap and move on
-        prev = cur;
-        itr += bk_size;
+/*
+ * carve never used blocks off the bump pointer of sbptr, up to the end
+ * of the page it points into, and chain them; returns the first one,
+ * NULL if every block was carved already; *lastp gets the last one
+ */
+block_h_t *carve_blocks(superblock_h_t *sbptr, block_h_t **lastp)
+{
+    size_t bk_size = class_to_size_[sbptr->size_class];
+    char *end = superblock_end(sbptr);
+    char *first = __atomic_load_n(&sbptr->bump, __ATOMIC_ACQUIRE);
+    char *stop;
+    do {
+        if (first >= end) return NULL;
+        uintptr_t page_end = ((uintptr_t)first + sys_page_size) &
+                             ~((uintptr_t)sys_page_size - 1);
+        size_t count = (page_end - (uintptr_t)first + bk_size - 1) / bk_size;
+        stop = first + count * bk_size;
+        if (stop > end) stop = end;
+    } while (!__atomic_compare_exchange_n(&sbptr->bump, &first, stop, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+
+    char *itr;
+    for (itr = first; itr + bk_size < stop; itr += bk_size) {
+        ((block_h_t *)itr)->next = (block_h_t *)(itr + bk_size);
     }
-    return sbptr;
+    ((block_h_t *)itr)->next = NULL;
+    *lastp = (block_h_t *)itr;
+    return (block_h_t *)first;
+}
+
+/*
+ * destorys an empty superblock of the global heap: the pages of its
+ * blocks go back to the OS and it restarts as a fresh, uncarved
+ * superblock; the header page stays, so it keeps its place in the heap;
+ * returns FAILURE if a block is in use or about to be popped;
+ * global_heap_lock[sc] must be held
+ */
+int destory_superblock(superblock_h_t *sbptr)
+{
+    // a CPU that swapped it out may still pop off it, but pops count
+    // their blocks in before they commit (reserve_blocks) and frees
+    // uncount them only after the push: with nothing counted, no block
+    // is in use or on its way to a list, and from SB_PURGING on every
+    // pop backs off
+    int in_use = 0;
+    if (!__atomic_compare_exchange_n(&sbptr->in_use_count, &in_use,
+                                     SB_PURGING, false, __ATOMIC_SEQ_CST,
+                                     __ATOMIC_RELAXED))
+        return FAILURE;
+
+    // so both lists hold free blocks only, drop them
+    void *old = __atomic_load_n(&sbptr->local_head, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&sbptr->local_head, &old,
+                                        TAG_SUCCESSOR(old, NULL), true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+    old = __atomic_load_n(&sbptr->remote_head, __ATOMIC_ACQUIRE);
+    while (!__atomic_compare_exchange_n(&sbptr->remote_head, &old,
+                                        TAG_SUCCESSOR(old, NULL), true,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+        ;
+
+    size_t bk_size = class_to_size_[sbptr->size_class];
+    madvise((char *)sbptr + sys_page_size, SB_SIZE - sys_page_size,
+            purge_advice);
+    sbptr->bump = (char *)sbptr + superblock_head_offset(bk_size);
+    sbptr->clean = 1;
+    // pops that backed off meanwhile take their counts back themselves
+    __atomic_fetch_sub(&sbptr->in_use_count, SB_PURGING, __ATOMIC_SEQ_CST);
+    return SUCCESS;
+}
+
+/*
+ * count $count blocks of sbptr in use before a pop commits them, so that
+ * destory_superblock() cannot purge what the pop is about to hand out;
+ * returns 0, with nothing counted, if it is being purged
+ */
+int reserve_blocks(superblock_h_t *sbptr, int count)
+{
+    if (__atomic_fetch_add(&sbptr->in_use_count, count, __ATOMIC_SEQ_CST) >= 0)
+        return 1;
+    __atomic_fetch_sub(&sbptr->in_use_count, count, __ATOMIC_RELAXED);
+    return 0;
+}
+
+/*
+ * uncount $count blocks reserve_blocks() counted that the pop did not
+ * get; a free that saw them counted could not tell the superblock
+ * emptied, so settle its fill here if it did
+ */
+void unreserve_blocks(superblock_h_t *sbptr, int count)
+{
+    if (count == 0) return;
+    if (__atomic_sub_fetch(&sbptr->in_use_count, count, __ATOMIC_ACQ_REL) == 0)
+        settle_superblock_fill(sbptr, 0, 0);
+}
+
+/*
+ * the global heap list matching the fill of sbptr
+ */
+static int superblock_fill(superblock_h_t *sbptr)
+{
+    if (__atomic_load_n(&sbptr->in_use_count, __ATOMIC_ACQUIRE) <= 0)
+        return SB_EMPTY;
+    if (TAGGED_PTR(sbptr->local_head) != NULL ||
+        TAGGED_PTR(__atomic_load_n(&sbptr->remote_head, __ATOMIC_ACQUIRE)) !=
+            NULL ||
+        __atomic_load_n(&sbptr->bump, __ATOMIC_ACQUIRE) < superblock_end(sbptr))
+        return SB_PARTIAL;
+    return SB_FULL;
+}
+
+/*
+ * unlink sbptr from its global heap list in O(1);
+ * global_heap_lock[sc] must be held
+ */
+static void unlink_superblock(superblock_h_t *sbptr)
+{
+    int sc = sbptr->size_class;
+    if (sbptr->list == SB_DETACHED) return;
+    if (sbptr->prev != NULL)
+        sbptr->prev->next = sbptr->next;
+    else
+        global_heap.lists[sbptr->list][sc] = sbptr->next;
+    if (sbptr->next != NULL) sbptr->next->prev = sbptr->prev;
+    sbptr->next = sbptr->prev = NULL;
+    sbptr->list = SB_DETACHED;
+}
+
+/*
+ * link sbptr at the front of the global heap list matching its fill;
+ * global_heap_lock[sc] must be held
+ */
+void add_superblock_to_global_heap(superblock_h_t *sbptr)
+{
+    int sc = sbptr->size_class;
+    int list = superblock_fill(sbptr);
+    sbptr->prev = NULL;
+    sbptr->next = global_heap.lists[list][sc];
+    if (sbptr->next != NULL) sbptr->next->prev = sbptr;
+    global_heap.lists[list][sc] = sbptr;
+    sbptr->list = list;
+    // the decay of an empty superblock starts now, at the latest
+    if (list == SB_EMPTY) sbptr->empty_since = purge_clock_ms();
+}
+
+/*
+ * called after a remote free that may have changed the fill of sbptr
+ * (first remote block, or last block in use); queues it once on the
+ * pending stack of its size class, without any lock
+ */
+void mark_superblock_pending(superblock_h_t *sbptr)
+{
+    if (__atomic_exchange_n(&sbptr->pending, 1, __ATOMIC_SEQ_CST)) return;
+    superblock_h_t **top = &global_heap.pending[sbptr->size_class];
+    superblock_h_t *old = __atomic_load_n(top, __ATOMIC_ACQUIRE);
+    do {
+        sbptr->pending_next = old;
+    } while (!__atomic_compare_exchange_n(top, &old, sbptr, true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
 }
 
 /*
- * destorys an empty superblock and the mutext lock
+ * move every pending superblock of sc to the list matching its fill;
+ * the stack is only ever taken whole, so it has no ABA problem;
+ * global_heap_lock[sc] must be held
  */
-void destory_superblock(superblock_h_t *sbptr)
+void sort_pending_superblocks(int sc)
 {
-    if (pthread_mutex_destroy(&sbptr->lock) == 0) {
-        sbptr = NULL;  // FIXME: really? this does not destory the instance
+    superblock_h_t *itr =
+        __atomic_exchange_n(&global_heap.pending[sc], NULL, __ATOMIC_ACQ_REL);
+    while (itr != NULL) {
+        superblock_h_t *next = itr->pending_next;
+        // clear first: a remote free from now on queues it again
+        __atomic_store_n(&itr->pending, 0, __ATOMIC_SEQ_CST);
+        // superblocks owned by a CPU get sorted when they come back
+        if (itr->list != SB_DETACHED && itr->list != superblock_fill(itr)) {
+            // keep the time the remote free that emptied it stamped
+            uint64_t since = itr->empty_since;
+            unlink_superblock(itr);
+            add_superblock_to_global_heap(itr);
+            itr->empty_since = since;
+        }
+        itr = next;
     }
 }
 
 /*
- * search from the head of global heap's superblock linked list
- * for a size class, find a superblock that has either non-null
- * local_head or non-null remote_head, else return NULL
+ * take a superblock with a free block off the global heap in O(1),
+ * partial ones before empty ones, and merge its remote list into its
+ * local list; returns NULL if there is none;
+ * global_heap_lock[sc] must be held
  */
 superblock_h_t *retrieve_superblock_from_global_heap(int sc)
 {
-    superblock_h_t *itr = cpu_heaps[sys_core_count].bins[sc], *prev_itr;
-    while (itr != NULL && itr->local_head == NULL && itr->remote_head == NULL) {
-        prev_itr = itr;
-        itr = itr->next;
+    sort_pending_superblocks(sc);
+    superblock_h_t *sbptr;
+    while ((sbptr = global_heap.lists[SB_PARTIAL][sc]) != NULL ||
+           (sbptr = global_heap.lists[SB_EMPTY][sc]) != NULL) {
+        unlink_superblock(sbptr);
+        sbptr->clean = 0;
+        reclaim_remote_blocks(sbptr);
+        if (TAGGED_PTR(sbptr->local_head) != NULL) return sbptr;
+        block_h_t *last, *first = carve_blocks(sbptr, &last);
+        if (first != NULL) {
+            cas_push_local_chain(sbptr, first, last);
+            return sbptr;
+        }
+        // drained meanwhile by a thread still holding it as its CPU's
+        add_superblock_to_global_heap(sbptr);
     }
-    return itr;
+    return NULL;
+}
+
+/*
+ * detach the whole remote list of sbptr in one atomic step;
+ * returns its first block, whose tail field gives the last one
+ */
+block_h_t *take_remote_blocks(superblock_h_t *sbptr)
+{
+    void *old = __atomic_load_n(&sbptr->remote_head, __ATOMIC_ACQUIRE);
+    do {
+        if (TAGGED_PTR(old) == NULL) return NULL;
+    } while (!__atomic_compare_exchange_n(&sbptr->remote_head, &old,
+                                          TAG_SUCCESSOR(old, NULL), true,
+                                          __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE));
+    return (block_h_t *)TAGGED_PTR(old);
+}
+
+/*
+ * detach sbptr's remote list and splice it onto the local list in O(1);
+ * only for superblocks no CPU owns, CPU owned ones go through
+ * release_blocks()
+ */
+void reclaim_remote_blocks(superblock_h_t *sbptr)
+{
+    block_h_t *first = take_remote_blocks(sbptr);
+    if (first == NULL) return;
+    cas_push_local_chain(sbptr, first, first->tail);
 }
 
 /*
@@ -371,75 +734,76 @@ superblock_h_t *retrieve_superblock_from_global_heap(int sc)
 block_h_t *search_local_block(int sc)
 {
     // FAST PATH: find one in local free list
-    int r = setjmp(critical_section_malloc);
+    uint64_t start = TELEM_START();
+    if (malloc_engine == ENGINE_SIGNAL) setjmp(critical_section_malloc);
     block_h_t *bptr = restartable_critical_section(sc);
-    if (bptr != NULL) return bptr;
-    // SLOW PATH: super block is empty, search in global heap
+    if (bptr != NULL) {
+        TELEM_RECORD(TELEM_FAST_MALLOC, start);
+        return bptr;
+    }
+    // SLOW PATH: take back what other CPUs freed into our superblock;
+    // the in-use counts were settled by the remote frees already
+    start = TELEM_START();
     superblock_h_t *local_sbptr = cpu_heaps[my_cpu].bins[sc];
+    block_h_t *first =
+        local_sbptr != NULL ? take_remote_blocks(local_sbptr) : NULL;
+    if (first != NULL) {
+        release_blocks(local_sbptr, first, first->tail, 0);
+        TELEM_RECORD(TELEM_SLOW_REFILL, start);
+        return search_local_block(sc);
+    }
+    // then carve the next page of never used blocks
+    block_h_t *last;
+    if (local_sbptr != NULL &&
+        (first = carve_blocks(local_sbptr, &last)) != NULL) {
+        release_blocks(local_sbptr, first, last, 0);
+        TELEM_RECORD(TELEM_SLOW_REFILL, start);
+        return search_local_block(sc);
+    }
+    // super block is used up (or not created yet), search in global heap
+    telemetry_lock(&global_heap_lock[sc]);
     superblock_h_t *global_sbptr = retrieve_superblock_from_global_heap(sc);
     if (global_sbptr == NULL) {
         // if all global superblocks are full, construct new
         size_t max_size = class_to_size_[sc];
-        int pages = class_to_pages_[sc];
-        global_sbptr = create_superblock(max_size, sc, pages);
-    } else {
-        // lock global_sbptr and merge its remote list into local list
-        pthread_mutex_lock(&global_sbptr->lock);
-        if (global_sbptr->local_head == NULL) {
-            global_sbptr->local_head = global_sbptr->remote_head;
-            global_sbptr->remote_head = NULL;
-        } else if (global_sbptr->remote_head != NULL) {
-            block_h_t *prev_itr, *itr = (block_h_t *)global_sbptr->local_head;
-            while (itr != NULL) {
-                prev_itr = itr;
-                itr = itr->next;
-            }
-            prev_itr->next = (block_h_t *)global_sbptr->remote_head;
-            global_sbptr->remote_head = NULL;
+        global_sbptr = create_superblock(max_size, sc);
+        if (global_sbptr == NULL) {
+            pthread_mutex_unlock(&global_heap_lock[sc]);
+            return NULL;
         }
-        pthread_mutex_unlock(&global_sbptr->lock);
     }
 
-    // (?) Do we need lock here, suppose another thread from another core
-    // comes in and claim global_sbptr, it will be shard by two cores.
+    // global_heap_lock[sc] keeps other cores off global_sbptr until it
+    // is installed here.
     // DO: move global_sbptr to local heap
-    // IF FAIL: move global_sbptr to global heap | (?) how can it fail
-    // IF SUCCESS: move local_sbptr to global heap | (DONE)
-
-    // below is SUCCESS case
-    // move g to l
-    cpu_heaps[my_cpu].bins[sc] = global_sbptr;
-    // move l to g
-    local_sbptr->next = NULL;
-    superblock_h_t *itr = cpu_heaps[sys_core_count].bins[sc];
-    superblock_h_t *prev_itr = NULL;
-    while (itr != NULL && ((char *)itr - (char *)global_sbptr) != 0) {
-        prev_itr = itr;
-        itr = itr->next;
-    }
-    // link l to global heap's sc linked list
-    if (prev_itr == NULL && itr == NULL) {
-        // never entered while loop, g is new, and global heap is empty
-        cpu_heaps[sys_core_count].bins[sc] = local_sbptr;
-    } else if (itr == NULL) {
-        // loop entered but exhausted, g is new, just append l to the end;
-        prev_itr->next = local_sbptr;
+    // IF FAIL: another thread of this core swapped first, put
+    //          global_sbptr back in global heap
+    // IF SUCCESS: move local_sbptr to global heap
+    if (!install_superblock(sc, local_sbptr, global_sbptr)) {
+        add_superblock_to_global_heap(global_sbptr);
     } else {
-        // itr is g, associate their nexts
-        if (prev_itr == NULL) {  // special case, first node hit
-            cpu_heaps[sys_core_count].bins[sc] = local_sbptr;
-        } else {
-            prev_itr->next = local_sbptr;
-        }
-        local_sbptr->next = itr->next;
+        global_sbptr->clean = 0;
+        if (local_sbptr != NULL) add_superblock_to_global_heap(local_sbptr);
     }
-    // finish moving g to l by NULLing the next of g (now l)
-    global_sbptr->next = NULL;
+    pthread_mutex_unlock(&global_heap_lock[sc]);
+    TELEM_RECORD(TELEM_NEW_SUPERBLOCK, start);
+    purge_tick();
 
     // retry
     return search_local_block(sc);
 }
 
+/*
+ * index in cpu_heaps of the CPU we run on, -1 if unknown; ids past
+ * sys_core_count only show up if it had to be guessed, and then only
+ * the cas engine runs, which tolerates CPUs sharing a heap
+ */
+int current_cpu_heap()
+{
+    int cpu = sched_getcpu();
+    return cpu < sys_core_count ? cpu : cpu % sys_core_count;
+}
+
 /*
  * restartable critical section
  * enters fast path if return value is not NULL
@@ -447,16 +811,18 @@ block_h_t *search_local_block(int sc)
  */
 block_h_t *restartable_critical_section(int sc)
 {
-    restartable = 1;
-
     // sanity check. TODO: think of moving this outside
-    if (sc == 0) {
-        restartable = 0;
-        return NULL;
-    }
+    if (sc == 0) return NULL;
+
+#ifdef USE_RSEQ
+    if (malloc_engine == ENGINE_RSEQ) return rseq_critical_section(sc);
+#endif
+    if (malloc_engine == ENGINE_CAS) return cas_critical_section(sc);
+
+    restartable = 1;
 
     // get current CPU id
-    my_cpu = sched_getcpu();
+    my_cpu = current_cpu_heap();
     if (my_cpu < 0) {
         restartable = 0;
         return NULL;
@@ -469,7 +835,7 @@ block_h_t *restartable_critical_section(int sc)
         restartable = 0;
         return NULL;
     }
-    block_h_t *bptr = (block_h_t *)sbptr->local_head;
+    block_h_t *bptr = (block_h_t *)TAGGED_PTR(sbptr->local_head);
     if (bptr == NULL) {
         restartable = 0;
         return NULL;
@@ -478,62 +844,152 @@ block_h_t *restartable_critical_section(int sc)
     // pop the local head off
     sbptr->local_head = (void *)bptr->next;
     // update flag and stats
-    sbptr->in_use_count++;
+    __atomic_fetch_add(&sbptr->in_use_count, 1, __ATOMIC_RELAXED);
     restartable = 0;
     return bptr;
 }
 
 /*
- * ask system for memory using mmap;
- * construct a block out of it and return;
+ * restartable critical section popping up to $max blocks at once;
+ * the caller must have set critical_section_malloc;
+ * returns the number of blocks, NULL terminated at *firstp,
+ * 0 if the slow path should be taken
+ */
+int restartable_critical_section_batch(int sc, int max, block_h_t **firstp)
+{
+    if (sc == 0) return 0;
+
+#ifdef USE_RSEQ
+    if (malloc_engine == ENGINE_RSEQ)
+        return rseq_critical_section_batch(sc, max, firstp);
+#endif
+    if (malloc_engine == ENGINE_CAS)
+        return cas_critical_section_batch(sc, max, firstp);
+
+    restartable = 1;
+
+    my_cpu = current_cpu_heap();
+    if (my_cpu < 0) {
+        restartable = 0;
+        return 0;
+    }
+
+    superblock_h_t *sbptr = cpu_heaps[my_cpu].bins[sc];
+    block_h_t *first = NULL, *last;
+    if (sbptr != NULL) first = (block_h_t *)TAGGED_PTR(sbptr->local_head);
+    if (first == NULL) {
+        restartable = 0;
+        return 0;
+    }
+
+    // cut the first $max blocks off the local list
+    int count = 1;
+    for (last = first; last->next != NULL && count < max; last = last->next)
+        count++;
+    sbptr->local_head = (void *)last->next;
+    last->next = NULL;
+
+    __atomic_fetch_add(&sbptr->in_use_count, count, __ATOMIC_RELAXED);
+    restartable = 0;
+    *firstp = first;
+    return count;
+}
+
+/*
+ * make new_sbptr the superblock of (my_cpu, sc) if old_sbptr still is;
+ * returns 1 on success, 0 if the slot changed under us
  */
-block_h_t *create_big_block(size_t size)
+int install_superblock(int sc, superblock_h_t *old_sbptr,
+                       superblock_h_t *new_sbptr)
 {
-    void *mmapped;
-    block_h_t *bptr;
+#ifdef USE_RSEQ
+    if (malloc_engine == ENGINE_RSEQ)
+        return rseq_install_superblock(my_cpu, sc, old_sbptr, new_sbptr);
+#endif
+    if (malloc_engine == ENGINE_CAS)
+        return cas_install_superblock(my_cpu, sc, old_sbptr, new_sbptr);
+    cpu_heaps[my_cpu].bins[sc] = new_sbptr;
+    return 1;
+}
 
-    if ((mmapped = mmap(NULL, size, PROT_READ | PROT_WRITE,
-                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0)) == MAP_FAILED) {
+/*
+ * reuse a cached mapping of the right length, else ask system for memory
+ * using mmap; construct a block out of it, register it in the page map
+ * and return; with $zero, a reused mapping is zeroed (fresh ones are)
+ */
+big_block_h_t *create_big_block(size_t size, int zero)
+{
+    size_t len = big_block_length(size);
+    big_block_h_t *bptr = big_cache_get(len);
+
+    if (bptr != NULL && zero) {
+        zero_block(bptr + 1, size - sizeof(big_block_h_t));
+    } else if (bptr == NULL) {
+        void *mmapped = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (mmapped == MAP_FAILED) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        bptr = (big_block_h_t *)mmapped;
+    }
+
+    bptr->size_class = BIG_BLOCK_CLASS;
+    bptr->length = len;
+    if (pagemap_set(bptr + 1, 1, bptr) != SUCCESS) {
+        munmap(bptr, len);
         errno = ENOMEM;
         return NULL;
     }
-
-    bptr = (block_h_t *)mmapped;
-    bptr->size_class = MAX_BINS + 1;  // FIXME: do we need plus one?
-    bptr->next = NULL;
+    STATS_COUNT(allocs, BIG_BLOCK_CLASS);
+    __atomic_fetch_add(&stats_big_bytes, len, __ATOMIC_RELAXED);
     return bptr;
 }
 
 /*
- * assign hook; compute size class;
- * retrieve block and return;
+ * compute size class; retrieve block and return; with $zero, the block
+ * is zeroed unless it is known to be fresh from the OS
  */
-void *__lib_malloc(size_t size)
+void *allocate_block(size_t size, int zero)
 {
-    block_h_t *ret_addr = NULL;
-    if (initialize_malloc() != SUCCESS) {
+    void *ret_addr = NULL;
+    if (size > MAX_BLOCK_SIZE || initialize_malloc() != SUCCESS) {
         errno = ENOMEM;
         return NULL;
     }
 
     // get size class; retrieve block
-    size += sizeof(block_h_t);
     int sc, sc_idx = class_index(size);
-    if (sc_idx < 0) {
-        // construct and return a big block
-        ret_addr = create_big_block(size);
+    if (sc_idx < 0 && size <= MAX_SPAN_SIZE) {
+        // a header-less span from the page heap, sized by the page
+        ret_addr = span_malloc(span_pages(size), 0, zero);
+    } else if (sc_idx < 0) {
+        // construct a big block, move pointer ahead for header size
+        big_block_h_t *big =
+            create_big_block(size + sizeof(big_block_h_t), zero);
+        if (big != NULL) ret_addr = (void *)(big + 1);
+    } else if ((sc = class_array_[sc_idx]) >= num_size_classes) {
+        // a header-less span of a span class
+        ret_addr = span_malloc(class_to_pages_[sc], sc, zero);
     } else {
-        // retreive block from local heap
-        sc = class_array_[sc_idx];
+        // retreive a header-less block from local heap
+#ifdef USE_THREAD_CACHE
+        ret_addr = thread_cache_malloc(sc);
+#else
         ret_addr = search_local_block(sc);
-        ret_addr->next = NULL;  // is this needed?
-    }
-
-    // move pointer ahead for header size
-    if (ret_addr != NULL) {
-        ret_addr = (void *)((char *)ret_addr + sizeof(block_h_t));
+#endif
+        if (ret_addr != NULL) STATS_COUNT(allocs, sc);
+        // recycled blocks and carved ones alike hold free list links
+        if (zero && ret_addr != NULL) memset(ret_addr, 0, size);
     }
+    if (__builtin_expect(profile_rate != 0, 0) && ret_addr != NULL)
+        profile_malloc(ret_addr, size);
     return ret_addr;
 }
 
+/*
+ * assign hook; allocate an uninitialized block
+ */
+void *__lib_malloc(size_t size) { return allocate_block(size, 0); }
+
 void *malloc(size_t size) __attribute__((weak, alias("__lib_malloc")));
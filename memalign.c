@@ -0,0 +1,122 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * smallest size class whose blocks are all aligned to $align (above
+ * REAL_SML_ALIGN) and hold $size bytes, if it wastes no more than
+ * over-allocating by $align would; -1 if there is none
+ */
+int aligned_class(size_t align, size_t size)
+{
+    int sc, sc_idx = class_index(size);
+    if (sc_idx < 0 || align > SPAN_PAGE_SIZE) return -1;
+    for (sc = class_array_[sc_idx]; sc < num_size_classes; sc++) {
+        if (class_to_size_[sc] >= size + align) break;
+        if (class_to_align_[sc] >= align) return sc;
+    }
+    return -1;
+}
+
+/*
+ * allocate $size bytes aligned to $align, a power of two: from an
+ * aligned_class() if any; else from a page aligned span, split on an
+ * $align boundary when that is larger than a page
+ */
+void *aligned_block(size_t align, size_t size)
+{
+    if (initialize_malloc() != SUCCESS) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (align <= REAL_SML_ALIGN) return allocate_block(size, 0);
+
+    void *ptr;
+    int sc = aligned_class(align, size);
+    if (sc >= 0) {
+#ifdef USE_THREAD_CACHE
+        ptr = thread_cache_malloc(sc);
+#else
+        ptr = search_local_block(sc);
+#endif
+        if (ptr != NULL) STATS_COUNT(allocs, sc);
+    } else {
+        size_t region = (char *)span_region_hi - (char *)span_region_lo;
+        if (size >= region || align >= region) {
+            errno = ENOMEM;
+            return NULL;
+        }
+        size_t pages = span_pages(size != 0 ? size : 1);
+        ptr = align <= SPAN_PAGE_SIZE ? span_malloc(pages, 0, 0)
+                                      : span_memalign(pages, align);
+    }
+    if (__builtin_expect(profile_rate != 0, 0) && ptr != NULL)
+        profile_malloc(ptr, size);
+    return ptr;
+}
+
+/*
+ * POSIX: $align must be a power of two multiple of sizeof(void *)
+ */
+int __lib_posix_memalign(void **memptr, size_t align, size_t size)
+{
+    if (align == 0 || align % sizeof(void *) != 0 ||
+        (align & (align - 1)) != 0)
+        return EINVAL;
+    void *ptr = aligned_block(align, size);
+    if (ptr == NULL) return ENOMEM;
+    *memptr = ptr;
+    return 0;
+}
+
+/*
+ * C11: $align must be a power of two
+ */
+void *__lib_aligned_alloc(size_t align, size_t size)
+{
+    if (align == 0 || (align & (align - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    return aligned_block(align, size);
+}
+
+/*
+ * obsolete; like glibc, an $align that is no power of two is rounded up
+ */
+void *__lib_memalign(size_t align, size_t size)
+{
+    if (align > ((size_t)1 << 63)) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (align & (align - 1)) align = (size_t)1 << (64 - __builtin_clzll(align));
+    return aligned_block(align, size);
+}
+
+void *__lib_valloc(size_t size) { return aligned_block(sys_page_size, size); }
+
+void *__lib_pvalloc(size_t size)
+{
+    size_t page = sys_page_size;
+    if (size > SIZE_MAX - page) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    return aligned_block(page, (size + page - 1) & ~(page - 1));
+}
+
+int posix_memalign(void **memptr, size_t align, size_t size)
+    __attribute__((weak, alias("__lib_posix_memalign")));
+void *aligned_alloc(size_t align, size_t size)
+    __attribute__((weak, alias("__lib_aligned_alloc")));
+void *memalign(size_t align, size_t size)
+    __attribute__((weak, alias("__lib_memalign")));
+void *valloc(size_t size) __attribute__((weak, alias("__lib_valloc")));
+void *pvalloc(size_t size) __attribute__((weak, alias("__lib_pvalloc")));
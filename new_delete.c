@@ -0,0 +1,133 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * C++ operator new and delete, every overload, exported under their
+ * Itanium ABI names so that they take over the libstdc++ ones, which
+ * only forward to malloc() and free(). new goes straight to the size
+ * class lookup; sized delete hands the size the compiler knows to
+ * free_sized(), which skips the owner search.
+ *
+ * The libstdc++ helpers are weak: a C program never calls new.
+ */
+
+typedef void (*new_handler_t)(void);
+extern new_handler_t cxx_get_new_handler(void)
+    __asm__("_ZSt15get_new_handlerv") __attribute__((weak));
+extern void cxx_throw_bad_alloc(void)
+    __asm__("_ZSt17__throw_bad_allocv") __attribute__((weak, noreturn));
+
+/*
+ * allocate $size bytes aligned to $align (0: default); on failure call
+ * the new_handler and retry. Once there is none, throw std::bad_alloc,
+ * or return NULL for the $nothrow forms. A handler that throws itself
+ * unwinds out of the nothrow forms too: C cannot catch it here
+ */
+static void *cxx_new(size_t size, size_t align, bool nothrow)
+{
+    for (;;) {
+        void *ptr = align > REAL_SML_ALIGN ? aligned_block(align, size)
+                                           : allocate_block(size, 0);
+        if (ptr != NULL) return ptr;
+        new_handler_t handler = NULL;
+        if (cxx_get_new_handler != NULL) handler = cxx_get_new_handler();
+        if (handler == NULL) {
+            if (nothrow) return NULL;
+            if (cxx_throw_bad_alloc != NULL) cxx_throw_bad_alloc();
+            abort();
+        }
+        handler();
+    }
+}
+
+void *__lib_new(size_t size) { return cxx_new(size, 0, false); }
+
+void *__lib_new_aligned(size_t size, size_t align)
+{
+    return cxx_new(size, align, false);
+}
+
+void *__lib_new_nothrow(size_t size, const void *nothrow)
+{
+    return cxx_new(size, 0, true);
+}
+
+void *__lib_new_aligned_nothrow(size_t size, size_t align,
+                                const void *nothrow)
+{
+    return cxx_new(size, align, true);
+}
+
+void __lib_delete(void *ptr) { __lib_free(ptr); }
+
+void __lib_delete_sized(void *ptr, size_t size)
+{
+    __lib_free_sized(ptr, size);
+}
+
+void __lib_delete_nothrow(void *ptr, const void *nothrow) { __lib_free(ptr); }
+
+void __lib_delete_aligned(void *ptr, size_t align) { __lib_free(ptr); }
+
+void __lib_delete_sized_aligned(void *ptr, size_t size, size_t align)
+{
+    __lib_free_aligned_sized(ptr, align, size);
+}
+
+void __lib_delete_aligned_nothrow(void *ptr, size_t align,
+                                  const void *nothrow)
+{
+    __lib_free(ptr);
+}
+
+// operator new / new[]
+void *_Znwm(size_t size) __attribute__((weak, alias("__lib_new")));
+void *_Znam(size_t size) __attribute__((weak, alias("__lib_new")));
+void *_ZnwmSt11align_val_t(size_t size, size_t align)
+    __attribute__((weak, alias("__lib_new_aligned")));
+void *_ZnamSt11align_val_t(size_t size, size_t align)
+    __attribute__((weak, alias("__lib_new_aligned")));
+void *_ZnwmRKSt9nothrow_t(size_t size, const void *nothrow)
+    __attribute__((weak, alias("__lib_new_nothrow")));
+void *_ZnamRKSt9nothrow_t(size_t size, const void *nothrow)
+    __attribute__((weak, alias("__lib_new_nothrow")));
+void *_ZnwmSt11align_val_tRKSt9nothrow_t(size_t size, size_t align,
+                                         const void *nothrow)
+    __attribute__((weak, alias("__lib_new_aligned_nothrow")));
+void *_ZnamSt11align_val_tRKSt9nothrow_t(size_t size, size_t align,
+                                         const void *nothrow)
+    __attribute__((weak, alias("__lib_new_aligned_nothrow")));
+
+// operator delete / delete[]
+void _ZdlPv(void *ptr) __attribute__((weak, alias("__lib_delete")));
+void _ZdaPv(void *ptr) __attribute__((weak, alias("__lib_delete")));
+void _ZdlPvm(void *ptr, size_t size)
+    __attribute__((weak, alias("__lib_delete_sized")));
+void _ZdaPvm(void *ptr, size_t size)
+    __attribute__((weak, alias("__lib_delete_sized")));
+void _ZdlPvRKSt9nothrow_t(void *ptr, const void *nothrow)
+    __attribute__((weak, alias("__lib_delete_nothrow")));
+void _ZdaPvRKSt9nothrow_t(void *ptr, const void *nothrow)
+    __attribute__((weak, alias("__lib_delete_nothrow")));
+void _ZdlPvSt11align_val_t(void *ptr, size_t align)
+    __attribute__((weak, alias("__lib_delete_aligned")));
+void _ZdaPvSt11align_val_t(void *ptr, size_t align)
+    __attribute__((weak, alias("__lib_delete_aligned")));
+void _ZdlPvmSt11align_val_t(void *ptr, size_t size, size_t align)
+    __attribute__((weak, alias("__lib_delete_sized_aligned")));
+void _ZdaPvmSt11align_val_t(void *ptr, size_t size, size_t align)
+    __attribute__((weak, alias("__lib_delete_sized_aligned")));
+void _ZdlPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align,
+                                         const void *nothrow)
+    __attribute__((weak, alias("__lib_delete_aligned_nothrow")));
+void _ZdaPvSt11align_val_tRKSt9nothrow_t(void *ptr, size_t align,
+                                         const void *nothrow)
+    __attribute__((weak, alias("__lib_delete_aligned_nothrow")));
@@ -0,0 +1,102 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Three level radix tree mapping a page number to the block header that
+ * owns the page (TCMalloc PageMap3 style). Superblocks are found by
+ * masking the address instead, so they are never registered here.
+ * A 48 bit address space with 4KB pages leaves 36 bits of page number,
+ * split 12/12/12. The root is static; interior nodes and leaves are
+ * mmapped on first use and never freed, so lookups need no lock: a
+ * missing node simply means "not ours".
+ */
+#define PAGEMAP_BITS (48 - PAGEMAP_PAGE_SHIFT)
+#define PAGEMAP_LEAF_BITS 12
+#define PAGEMAP_MID_BITS 12
+#define PAGEMAP_ROOT_BITS (PAGEMAP_BITS - PAGEMAP_LEAF_BITS - PAGEMAP_MID_BITS)
+#define PAGEMAP_LEAF_LEN (1 << PAGEMAP_LEAF_BITS)
+#define PAGEMAP_MID_LEN (1 << PAGEMAP_MID_BITS)
+#define PAGEMAP_ROOT_LEN (1 << PAGEMAP_ROOT_BITS)
+
+typedef struct _pagemap_leaf {
+    void *owners[PAGEMAP_LEAF_LEN];
+} pagemap_leaf_t;
+
+typedef struct _pagemap_mid {
+    pagemap_leaf_t *leaves[PAGEMAP_MID_LEN];
+} pagemap_mid_t;
+
+static pagemap_mid_t *pagemap_root[PAGEMAP_ROOT_LEN];
+
+/*
+ * mmap a zeroed node and race to publish it in *slot;
+ * returns whichever node ended up in the slot, NULL if out of memory
+ */
+static void *pagemap_ensure_node(void **slot, size_t size)
+{
+    void *node = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (node != NULL) return node;
+
+    void *fresh = mmap(NULL, size, PROT_READ | PROT_WRITE,
+                       MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (fresh == MAP_FAILED) return NULL;
+    if (!__atomic_compare_exchange_n(slot, &node, fresh, false,
+                                     __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        munmap(fresh, size);  // lost the race, node holds the winner
+        return node;
+    }
+    return fresh;
+}
+
+/*
+ * map every page overlapping [addr, addr + len) to $owner;
+ * passing NULL as owner unregisters the pages
+ */
+int pagemap_set(void *addr, size_t len, void *owner)
+{
+    uintptr_t page = (uintptr_t)addr >> PAGEMAP_PAGE_SHIFT;
+    uintptr_t last = ((uintptr_t)addr + len - 1) >> PAGEMAP_PAGE_SHIFT;
+    for (; page <= last; page++) {
+        uintptr_t i1 = page >> (PAGEMAP_LEAF_BITS + PAGEMAP_MID_BITS);
+        uintptr_t i2 = (page >> PAGEMAP_LEAF_BITS) & (PAGEMAP_MID_LEN - 1);
+        uintptr_t i3 = page & (PAGEMAP_LEAF_LEN - 1);
+        if (i1 >= PAGEMAP_ROOT_LEN) return FAILURE;
+
+        pagemap_mid_t *mid = pagemap_ensure_node((void **)&pagemap_root[i1],
+                                                 sizeof(pagemap_mid_t));
+        if (mid == NULL) return FAILURE;
+        pagemap_leaf_t *leaf = pagemap_ensure_node(
+            (void **)&mid->leaves[i2], sizeof(pagemap_leaf_t));
+        if (leaf == NULL) return FAILURE;
+        __atomic_store_n(&leaf->owners[i3], owner, __ATOMIC_RELEASE);
+    }
+    return SUCCESS;
+}
+
+/*
+ * returns the owner of the page of $addr, NULL if none
+ */
+void *pagemap_get(void *addr)
+{
+    uintptr_t page = (uintptr_t)addr >> PAGEMAP_PAGE_SHIFT;
+    uintptr_t i1 = page >> (PAGEMAP_LEAF_BITS + PAGEMAP_MID_BITS);
+    if (i1 >= PAGEMAP_ROOT_LEN) return NULL;
+
+    pagemap_mid_t *mid = __atomic_load_n(&pagemap_root[i1], __ATOMIC_ACQUIRE);
+    if (mid == NULL) return NULL;
+    pagemap_leaf_t *leaf = __atomic_load_n(
+        &mid->leaves[(page >> PAGEMAP_LEAF_BITS) & (PAGEMAP_MID_LEN - 1)],
+        __ATOMIC_ACQUIRE);
+    if (leaf == NULL) return NULL;
+    return __atomic_load_n(&leaf->owners[page & (PAGEMAP_LEAF_LEN - 1)],
+                           __ATOMIC_ACQUIRE);
+}
@@ -0,0 +1,416 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <execinfo.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Sampling heap profiler.
+ *
+ * SPEEDYLOC_PROFILE=<prefix> samples one allocation every
+ * SPEEDYLOC_PROFILE_RATE bytes (PROFILE_RATE by default) on average: each
+ * thread counts down a geometrically distributed number of bytes, and the
+ * allocation that crosses zero gets its stack trace, size and size class
+ * recorded. Its free is recorded too, so a dump holds both the live heap
+ * and everything sampled since the start, per stack trace, in the legacy
+ * text format of pprof (heap_v2, which pprof unsamples by the rate).
+ *
+ * PROFILE_DUMP_SIGNAL writes <prefix>.<pid>.<seq>.heap, and so does
+ * speedyloc_profile_dump(NULL); speedyloc_profile_dump(path) writes path.
+ *
+ * With the profiler off, malloc and free pay one branch on profile_rate.
+ * With it on, a free looks the block up in the sample table, which takes
+ * the lock only if its hash bucket holds any sample. Records are mmapped
+ * here, never malloced, and a thread that allocates while sampling (e.g.
+ * backtrace() loading libgcc) is not sampled again.
+ */
+
+size_t profile_rate = 0;  // 0: off
+static const char *profile_prefix = NULL;
+static int profile_seq = 0;
+static pthread_mutex_t profile_lock = PTHREAD_MUTEX_INITIALIZER;
+static volatile sig_atomic_t profile_dump_pending = 0;
+
+static __thread int64_t profile_countdown = 0;  // bytes to the next sample
+static __thread uint64_t profile_seed = 0;
+static __thread int profile_busy = 0;
+
+static profile_sample_t *profile_samples[1 << PROFILE_SAMPLE_BITS];
+static profile_stack_t *profile_stacks[1 << PROFILE_STACK_BITS];
+static profile_sample_t *profile_free_samples = NULL;
+static char *profile_pool = NULL;  // records are carved from here
+static size_t profile_pool_left = 0;
+
+// sampled allocations per size class since the start
+static size_t profile_class_allocs[BIG_BLOCK_CLASS + 1];
+static size_t profile_class_bytes[BIG_BLOCK_CLASS + 1];
+
+static void profile_signal(int sig);
+
+/*
+ * read the profiler settings from the environment; installs the dump
+ * signal handler if it is on
+ */
+int initialize_profile()
+{
+    char *prefix = getenv("SPEEDYLOC_PROFILE");
+    if (prefix == NULL || *prefix == '\0') return SUCCESS;
+    profile_prefix = prefix;
+
+    char *rate = getenv("SPEEDYLOC_PROFILE_RATE");
+    long long parsed = rate != NULL ? atoll(rate) : 0;
+    profile_rate = parsed > 0 ? (size_t)parsed : PROFILE_RATE;
+
+    struct sigaction sa;
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = profile_signal;
+    sa.sa_flags = SA_RESTART;
+    sigaction(PROFILE_DUMP_SIGNAL, &sa, NULL);
+    return SUCCESS;
+}
+
+/*
+ * bytes to count down to the next sample: exponentially distributed with
+ * mean profile_rate, so that samples form a Poisson process over the
+ * allocated bytes, as pprof assumes when it unsamples
+ */
+static int64_t profile_interval()
+{
+    if (profile_seed == 0)
+        profile_seed = (uint64_t)(uintptr_t)&profile_seed ^ telemetry_clock();
+    // xorshift64*, 53 bits of it make a double in (0, 1]
+    profile_seed ^= profile_seed >> 12;
+    profile_seed ^= profile_seed << 25;
+    profile_seed ^= profile_seed >> 27;
+    uint64_t bits = (profile_seed * 0x2545F4914F6CDD1DULL) >> 11;
+    double u = (bits + 1.0) / 9007199254740992.0;
+    return (int64_t)(-log(u) * profile_rate) + 1;
+}
+
+/*
+ * carve $size bytes off the record pool; profile_lock must be held
+ */
+static void *profile_alloc(size_t size)
+{
+    size = (size + 15) & ~(size_t)15;
+    if (size > profile_pool_left) {
+        void *pool = mmap(NULL, PROFILE_POOL, PROT_READ | PROT_WRITE,
+                          MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (pool == MAP_FAILED) return NULL;
+        profile_pool = pool;
+        profile_pool_left = PROFILE_POOL;
+    }
+    void *ptr = profile_pool;
+    profile_pool += size;
+    profile_pool_left -= size;
+    return ptr;
+}
+
+static inline size_t profile_sample_bucket(void *ptr)
+{
+    return (size_t)(((uintptr_t)ptr >> 4) * 0x9E3779B97F4A7C15ULL >>
+                    (64 - PROFILE_SAMPLE_BITS));
+}
+
+/*
+ * find or make the record of the stack trace frames[0, depth);
+ * profile_lock must be held
+ */
+static profile_stack_t *profile_stack(void **frames, int depth)
+{
+    uint64_t hash = 0;
+    int i;
+    for (i = 0; i < depth; i++)
+        hash = (hash + (uintptr_t)frames[i]) * 0x9E3779B97F4A7C15ULL;
+    profile_stack_t **bucket =
+        &profile_stacks[hash >> (64 - PROFILE_STACK_BITS)];
+
+    profile_stack_t *stack;
+    for (stack = *bucket; stack != NULL; stack = stack->next) {
+        if (stack->hash == hash && stack->depth == depth &&
+            memcmp(stack->frames, frames, depth * sizeof(void *)) == 0)
+            return stack;
+    }
+    if ((stack = profile_alloc(sizeof(profile_stack_t))) == NULL) return NULL;
+    memset(stack, 0, sizeof(*stack));
+    stack->hash = hash;
+    stack->depth = depth;
+    memcpy(stack->frames, frames, depth * sizeof(void *));
+    stack->next = *bucket;
+    *bucket = stack;
+    return stack;
+}
+
+/*
+ * size class the block at $ptr came from, as profile_sample_t keeps it
+ */
+static int profile_class(void *ptr)
+{
+    superblock_h_t *mama_s = retrieve_mamablock(ptr);
+    if (mama_s != NULL) return mama_s->size_class;
+    span_t *span = span_of(ptr);
+    if (span != NULL) return span->size_class;
+    return BIG_BLOCK_CLASS;
+}
+
+/*
+ * dump if a signal asked for it while the lock was held
+ */
+static void profile_unlock()
+{
+    pthread_mutex_unlock(&profile_lock);
+    if (profile_dump_pending) profile_signal(PROFILE_DUMP_SIGNAL);
+}
+
+/*
+ * count $size bytes allocated at $ptr against this thread's countdown,
+ * and sample the allocation that crosses zero
+ */
+void profile_malloc(void *ptr, size_t size)
+{
+    if (profile_busy) return;
+    if (profile_seed == 0) profile_countdown = profile_interval();
+    profile_countdown -= (int64_t)size;
+    if (profile_countdown > 0) return;
+    profile_countdown = profile_interval();
+
+    profile_busy = 1;
+    void *frames[PROFILE_DEPTH + PROFILE_SKIP];
+    int depth = backtrace(frames, PROFILE_DEPTH + PROFILE_SKIP);
+    depth = depth > PROFILE_SKIP ? depth - PROFILE_SKIP : 0;
+    int sc = profile_class(ptr);
+
+    pthread_mutex_lock(&profile_lock);
+    profile_stack_t *stack = profile_stack(frames + PROFILE_SKIP, depth);
+    profile_sample_t *sample = profile_free_samples;
+    if (sample != NULL) {
+        profile_free_samples = sample->next;
+    } else {
+        sample = profile_alloc(sizeof(profile_sample_t));
+    }
+    if (stack != NULL && sample != NULL) {
+        stack->allocs++;
+        stack->alloc_bytes += size;
+        profile_class_allocs[sc]++;
+        profile_class_bytes[sc] += size;
+        sample->ptr = ptr;
+        sample->size = size;
+        sample->size_class = sc;
+        sample->stack = stack;
+        profile_sample_t **bucket =
+            &profile_samples[profile_sample_bucket(ptr)];
+        sample->next = *bucket;
+        __atomic_store_n(bucket, sample, __ATOMIC_RELEASE);
+    } else if (sample != NULL) {
+        sample->next = profile_free_samples;  // out of record space
+        profile_free_samples = sample;
+    }
+    profile_unlock();
+    profile_busy = 0;
+}
+
+/*
+ * forget the sample of the block at $ptr, if it was sampled; must be
+ * called before the block can be handed out again
+ */
+void profile_free(void *ptr)
+{
+    profile_sample_t **bucket = &profile_samples[profile_sample_bucket(ptr)];
+    if (__atomic_load_n(bucket, __ATOMIC_ACQUIRE) == NULL) return;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_sample_t **itr;
+    for (itr = bucket; *itr != NULL; itr = &(*itr)->next) {
+        profile_sample_t *sample = *itr;
+        if (sample->ptr != ptr) continue;
+        __atomic_store_n(itr, sample->next, __ATOMIC_RELEASE);
+        sample->stack->frees++;
+        sample->stack->free_bytes += sample->size;
+        sample->next = profile_free_samples;
+        profile_free_samples = sample;
+        break;
+    }
+    profile_unlock();
+}
+
+/*
+ * unlink the sample of the block at $ptr without recording a free, for a
+ * block about to move; returns it for profile_put(), NULL if not sampled
+ */
+profile_sample_t *profile_take(void *ptr)
+{
+    profile_sample_t **bucket = &profile_samples[profile_sample_bucket(ptr)];
+    if (__atomic_load_n(bucket, __ATOMIC_ACQUIRE) == NULL) return NULL;
+
+    pthread_mutex_lock(&profile_lock);
+    profile_sample_t **itr, *sample = NULL;
+    for (itr = bucket; *itr != NULL; itr = &(*itr)->next) {
+        if ((*itr)->ptr != ptr) continue;
+        sample = *itr;
+        __atomic_store_n(itr, sample->next, __ATOMIC_RELEASE);
+        break;
+    }
+    profile_unlock();
+    return sample;
+}
+
+/*
+ * link a sample from profile_take() back, for the block now at $ptr
+ */
+void profile_put(profile_sample_t *sample, void *ptr)
+{
+    if (sample == NULL) return;
+    pthread_mutex_lock(&profile_lock);
+    sample->ptr = ptr;
+    profile_sample_t **bucket = &profile_samples[profile_sample_bucket(ptr)];
+    sample->next = *bucket;
+    __atomic_store_n(bucket, sample, __ATOMIC_RELEASE);
+    profile_unlock();
+}
+
+/*
+ * printf to $fd through a buffer on the stack: no malloc, so that the
+ * dump signal may interrupt the allocator
+ */
+static void profile_printf(int fd, const char *fmt, ...)
+{
+    char buf[512];
+    va_list args;
+    va_start(args, fmt);
+    int len = vsnprintf(buf, sizeof(buf), fmt, args);
+    va_end(args);
+    if (len > (int)sizeof(buf) - 1) len = sizeof(buf) - 1;
+    if (len > 0 && write(fd, buf, len) < 0) return;
+}
+
+/*
+ * write the profile to $fd; profile_lock must be held
+ */
+static void profile_write(int fd)
+{
+    size_t live_objs = 0, live_bytes = 0, all_objs = 0, all_bytes = 0;
+    size_t class_objs[BIG_BLOCK_CLASS + 1] = {0};
+    size_t class_live[BIG_BLOCK_CLASS + 1] = {0};
+    profile_stack_t *stack;
+    profile_sample_t *sample;
+    int i, sc;
+    for (i = 0; i < (1 << PROFILE_STACK_BITS); i++) {
+        for (stack = profile_stacks[i]; stack != NULL; stack = stack->next) {
+            live_objs += stack->allocs - stack->frees;
+            live_bytes += stack->alloc_bytes - stack->free_bytes;
+            all_objs += stack->allocs;
+            all_bytes += stack->alloc_bytes;
+        }
+    }
+    for (i = 0; i < (1 << PROFILE_SAMPLE_BITS); i++) {
+        for (sample = profile_samples[i]; sample != NULL;
+             sample = sample->next) {
+            class_objs[sample->size_class]++;
+            class_live[sample->size_class] += sample->size;
+        }
+    }
+
+    profile_printf(fd, "heap profile: %zu: %zu [%zu: %zu] @ heap_v2/%zu\n",
+                   live_objs, live_bytes, all_objs, all_bytes, profile_rate);
+    // pprof skips comments: the size classes of the samples, live and all
+    for (sc = 0; sc <= BIG_BLOCK_CLASS; sc++) {
+        if (profile_class_allocs[sc] == 0) continue;
+        profile_printf(fd, "# class %d size %zu: %zu: %zu [%zu: %zu]\n", sc,
+                       sc > 0 && sc < BIG_BLOCK_CLASS ? class_to_size_[sc] : 0,
+                       class_objs[sc], class_live[sc], profile_class_allocs[sc],
+                       profile_class_bytes[sc]);
+    }
+    for (i = 0; i < (1 << PROFILE_STACK_BITS); i++) {
+        for (stack = profile_stacks[i]; stack != NULL; stack = stack->next) {
+            // 4 counts and " 0x" plus 16 digits per frame always fit
+            char line[128 + PROFILE_DEPTH * 20];
+            int len = snprintf(line, sizeof(line), "%zu: %zu [%zu: %zu] @",
+                               stack->allocs - stack->frees,
+                               stack->alloc_bytes - stack->free_bytes,
+                               stack->allocs, stack->alloc_bytes);
+            int f;
+            for (f = 0; f < stack->depth; f++)
+                len += snprintf(line + len, sizeof(line) - len, " %p",
+                                stack->frames[f]);
+            line[len++] = '\n';
+            if (write(fd, line, len) != len) return;
+        }
+    }
+
+    // pprof maps the addresses to symbols with these
+    profile_printf(fd, "\nMAPPED_LIBRARIES:\n");
+    int maps = open("/proc/self/maps", O_RDONLY);
+    if (maps < 0) return;
+    char buf[4096];
+    ssize_t len;
+    while ((len = read(maps, buf, sizeof(buf))) > 0)
+        if (write(fd, buf, len) != len) break;
+    close(maps);
+}
+
+/*
+ * dump the profile to $path, or to the next <prefix>.<pid>.<seq>.heap
+ * if NULL; profile_lock must be held. returns SUCCESS or FAILURE
+ */
+static int profile_dump_locked(const char *path)
+{
+    char name[4096];
+    if (path == NULL) {
+        snprintf(name, sizeof(name), "%s.%d.%04d.heap",
+                 profile_prefix != NULL ? profile_prefix : "speedyloc",
+                 getpid(), profile_seq++);
+        path = name;
+    }
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) return FAILURE;
+    profile_write(fd);
+    close(fd);
+    return SUCCESS;
+}
+
+/*
+ * dump signal handler: dumps right away, or has the thread holding the
+ * lock dump once it lets go of it
+ */
+static void profile_signal(int sig)
+{
+    (void)sig;
+    int saved = errno;
+    if (pthread_mutex_trylock(&profile_lock) != 0) {
+        profile_dump_pending = 1;
+        errno = saved;
+        return;
+    }
+    profile_dump_pending = 0;
+    profile_dump_locked(NULL);
+    pthread_mutex_unlock(&profile_lock);
+    errno = saved;
+}
+
+/*
+ * query API: dump the profile to $path (NULL: the next numbered file);
+ * returns SUCCESS, or FAILURE if the profiler is off or $path can't be
+ * written
+ */
+int speedyloc_profile_dump(const char *path)
+{
+    if (profile_rate == 0) return FAILURE;
+    pthread_mutex_lock(&profile_lock);
+    int out = profile_dump_locked(path);
+    profile_unlock();
+    return out;
+}
@@ -0,0 +1,134 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Decay based purging of empty superblocks and free spans (jemalloc
+ * style).
+ *
+ * A superblock whose last block in use comes back sits on the SB_EMPTY
+ * list of the global heap, stamped with the time it got there. Once it
+ * has stayed empty for purge_decay_ms, destory_superblock() hands its
+ * pages back to the OS. Free spans of the page heap are stamped when
+ * they are freed, and span_decay() releases them the same way; so does
+ * big_cache_decay() with the mappings of the big block cache.
+ *
+ * There is no background thread: passes are run from the slow paths,
+ * from span and big block frees and every PURGE_TICK_FREES frees of a
+ * thread, at most one per PURGE_INTERVAL_MS, and malloc_trim() forces
+ * one that ignores the decay.
+ *
+ * SPEEDYLOC_DECAY_MS sets the decay (negative: never purge) and
+ * SPEEDYLOC_PURGE=free picks MADV_FREE over MADV_DONTNEED.
+ *
+ * In huge page mode superblocks are never purged: every superblock keeps
+ * its header inside the huge page it shares with the other superblocks
+ * of its chunk, so purging one would only split the huge page. Spans
+ * are still purged, by whole huge pages (see span_trim()).
+ */
+
+int purge_decay_ms = PURGE_DECAY_MS;
+int purge_advice = MADV_DONTNEED;
+static uint64_t next_purge_ms = 0;
+
+int __lib_malloc_trim(size_t pad);
+
+/*
+ * read the purge settings from the environment
+ */
+int initialize_purge()
+{
+    char *decay = getenv("SPEEDYLOC_DECAY_MS");
+    if (decay != NULL) purge_decay_ms = atoi(decay);
+    char *advice = getenv("SPEEDYLOC_PURGE");
+    if (advice != NULL && strcmp(advice, "free") == 0)
+        purge_advice = MADV_FREE;
+    return SUCCESS;
+}
+
+/*
+ * coarse monotonic clock in ms, cheap enough for the slow paths
+ */
+uint64_t purge_clock_ms()
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC_COARSE, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/*
+ * sort the pending superblocks of sc, then purge every resident one
+ * that has been empty for $decay_ms at least; returns the number purged;
+ * global_heap_lock[sc] must be held
+ */
+static int purge_superblocks(int sc, uint64_t decay_ms)
+{
+    sort_pending_superblocks(sc);
+    if (arena_thp != THP_OFF) return 0;
+    uint64_t now = purge_clock_ms();
+    int purged = 0;
+    superblock_h_t *itr = global_heap.lists[SB_EMPTY][sc];
+    for (; itr != NULL; itr = itr->next) {
+        if (itr->clean || now - itr->empty_since < decay_ms) continue;
+        if (destory_superblock(itr) == SUCCESS) purged++;
+    }
+    return purged;
+}
+
+/*
+ * called from the slow paths: once per PURGE_INTERVAL_MS, one thread
+ * purges the superblocks, free spans and cached big blocks whose decay
+ * ran out; whatever has its lock busy waits for the next pass
+ */
+void purge_tick()
+{
+    if (purge_decay_ms < 0) return;
+    uint64_t now = purge_clock_ms();
+    uint64_t next = __atomic_load_n(&next_purge_ms, __ATOMIC_RELAXED);
+    if (now < next) return;
+    if (!__atomic_compare_exchange_n(&next_purge_ms, &next,
+                                     now + PURGE_INTERVAL_MS, false,
+                                     __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        return;
+
+    int sc;
+    for (sc = 1; sc < num_size_classes; sc++) {
+        if (pthread_mutex_trylock(&global_heap_lock[sc]) != 0) continue;
+        purge_superblocks(sc, purge_decay_ms);
+        pthread_mutex_unlock(&global_heap_lock[sc]);
+    }
+    span_decay(purge_decay_ms);
+    big_cache_decay(purge_decay_ms);
+}
+
+/*
+ * purge every empty superblock of the global heap now, decay or not,
+ * release the free spans and unmap the cached big blocks;
+ * $pad is ignored, superblocks are purged whole;
+ * returns 1 if any memory went back to the OS, else 0
+ */
+int __lib_malloc_trim(size_t pad)
+{
+    if (initialize_malloc() != SUCCESS) return 0;
+
+    int sc, purged = 0;
+    for (sc = 1; sc < num_size_classes; sc++) {
+        telemetry_lock(&global_heap_lock[sc]);
+        purged += purge_superblocks(sc, 0);
+        pthread_mutex_unlock(&global_heap_lock[sc]);
+    }
+    size_t released = big_cache_flush() + span_trim();
+    return purged > 0 || released > 0;
+}
+
+int malloc_trim(size_t pad) __attribute__((weak, alias("__lib_malloc_trim")));
@@ -0,0 +1,116 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * resize a big block with mremap, moving it only if its range cannot
+ * grow; returns the new user pointer, NULL if the kernel refused, in
+ * which case the block is left as it was
+ */
+static void *realloc_big_block(big_block_h_t *big, size_t size)
+{
+    size_t len = big_block_length(size + sizeof(big_block_h_t));
+    size_t old_len = big->length;
+    if (len == old_len) return big + 1;
+
+    // shrinking, or growing into free address space right after it
+    if (mremap(big, old_len, len, 0) != MAP_FAILED) {
+        big->length = len;
+        __atomic_fetch_add(&stats_big_bytes, len - old_len, __ATOMIC_RELAXED);
+        return big + 1;
+    }
+
+    // the pages have to move: map and register the destination first, so
+    // that no failure can leave the block moved but unknown to the pagemap
+    big_block_h_t *dest = mmap(NULL, len, PROT_READ | PROT_WRITE,
+                               MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (dest == MAP_FAILED) return NULL;
+    if (pagemap_set(dest + 1, 1, dest) != SUCCESS) {
+        munmap(dest, len);
+        return NULL;
+    }
+
+    // unregister the old address before the move: once the pages are
+    // gone, another thread may map and register a new big block there;
+    // its sample is taken out of the profiler for the same reason
+    pagemap_set(big + 1, 1, NULL);
+    profile_sample_t *sample = profile_rate != 0 ? profile_take(big + 1) : NULL;
+    if (mremap(big, old_len, len, MREMAP_MAYMOVE | MREMAP_FIXED, dest) ==
+        MAP_FAILED) {
+        // the block stays put; the kernel may or may not have unmapped
+        // $dest already, depending on where it gave up
+        munmap(dest, len);
+        pagemap_set(dest + 1, 1, NULL);
+        pagemap_set(big + 1, 1, big);
+        profile_put(sample, big + 1);
+        return NULL;
+    }
+    profile_put(sample, dest + 1);
+    dest->length = len;
+    __atomic_fetch_add(&stats_big_bytes, len - old_len, __ATOMIC_RELAXED);
+    return dest + 1;
+}
+
+/*
+ * resize the block at $ptr to $size bytes: in place while it fits the
+ * block (and shrinks by less than half), by resizing its span or
+ * remapping its big block when the new size stays in the same tier,
+ * else by a malloc, copy and free
+ */
+void *__lib_realloc(void *ptr, size_t size)
+{
+    if (ptr == NULL) return __lib_malloc(size);
+    if (size > MAX_BLOCK_SIZE) {
+        errno = ENOMEM;
+        return NULL;
+    }
+    if (size == 0) {
+        __lib_free(ptr);
+        return NULL;
+    }
+
+    size_t usable;
+    superblock_h_t *mama_s;
+    span_t *span;
+    big_block_h_t *big;
+    if ((mama_s = retrieve_mamablock(ptr)) != NULL) {
+        usable = class_to_size_[mama_s->size_class];
+    } else if ((span = span_of(ptr)) != NULL) {
+        usable = span->pages << SPAN_PAGE_SHIFT;
+        // medium to medium: move the end of the span only
+        if (size > MAX_LRG_SIZE && size <= MAX_SPAN_SIZE &&
+            (size > usable || size <= usable / 2) &&
+            span_resize(span, span_pages(size)) == SUCCESS)
+            return ptr;
+    } else if ((big = pagemap_get(ptr)) != NULL && big + 1 == ptr) {
+        usable = big->length - sizeof(big_block_h_t);
+        // big to big: let the kernel move the pages, no copy
+        if (size > MAX_SPAN_SIZE) {
+            void *moved = realloc_big_block(big, size);
+            if (moved != NULL) return moved;
+        }
+    } else {
+        errno = EINVAL;
+        return NULL;
+    }
+
+    // the block still fits, or has to move
+    if (size <= usable && size > usable / 2) return ptr;
+    void *new_ptr = __lib_malloc(size);
+    if (new_ptr == NULL) return NULL;
+    memcpy(new_ptr, ptr, size < usable ? size : usable);
+    __lib_free(ptr);
+    return new_ptr;
+}
+
+void *realloc(void *ptr, size_t size)
+    __attribute__((weak, alias("__lib_realloc")));
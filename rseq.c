@@ -0,0 +1,313 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/rseq.h>
+#include <unistd.h>
+#include "common.h"
+
+#define RSEQ_ABORTED (-1L)
+
+/*
+ * Restartable sequences (rseq) backend for the per-CPU critical sections.
+ *
+ * Every critical section below is a single asm block registered in the
+ * __rseq_cs section: [1, 2) is the restartable range, the store right
+ * before label 2 is the commit, and label 4 is the abort handler. The
+ * kernel moves the instruction pointer to the abort handler only if the
+ * thread is preempted, migrated or signalled inside [1, 2), so there is
+ * no signal, no longjmp and no driver involved. The abort handler lives
+ * in __rseq_failure and is preceded by RSEQ_SIG, as the kernel requires.
+ *
+ * glibc (>= 2.35) registers the rseq area for every thread; we only use
+ * that registration and never register our own.
+ */
+#define RSEQ_CS_DESCRIPTOR                        \
+    ".pushsection __rseq_cs, \"aw\"\n\t"          \
+    ".balign 32\n\t"                              \
+    "3:\n\t"                                      \
+    ".long 0x0, 0x0\n\t"                          \
+    ".quad 1f, (2f - 1f), 4f\n\t"                 \
+    ".popsection\n\t"                             \
+    "leaq 3b(%%rip), %%rax\n\t"                   \
+    "movq %%rax, %[rseq_cs]\n\t"
+
+#define RSEQ_ABORT_HANDLER(ret)                   \
+    ".pushsection __rseq_failure, \"ax\"\n\t"     \
+    ".byte 0x0f, 0xb9, 0x3d\n\t"                  \
+    ".long 0x53053053\n\t"                        \
+    "4:\n\t"                                      \
+    "movq $-1, %[" #ret "]\n\t"                   \
+    "jmp 2b\n\t"                                  \
+    ".popsection\n\t"
+
+static inline struct rseq *rseq_area()
+{
+    return (struct rseq *)((char *)__builtin_thread_pointer() + __rseq_offset);
+}
+
+/*
+ * returns 1 if glibc registered an rseq area for this thread
+ */
+int rseq_available()
+{
+    if (__rseq_size == 0) return 0;
+    return (int)rseq_area()->cpu_id >= 0;
+}
+
+/*
+ * on $cpu, pop the local head of $sbptr if it still is the superblock
+ * in *binp; returns the popped block, NULL if there is nothing to pop
+ * or sbptr was swapped out, or RSEQ_ABORTED if the kernel restarted us
+ */
+static inline long rseq_pop(struct rseq *rs, int cpu, superblock_h_t **binp,
+                            superblock_h_t *sbptr)
+{
+    long ret;
+    __asm__ __volatile__(
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "xorq %[ret], %[ret]\n\t"
+        "cmpl %[cpu_id], %[cpu]\n\t"
+        "jnz 4f\n\t"
+        "cmpq (%[binp]), %[sb]\n\t"
+        "jnz 2f\n\t"
+        "movq %c[head_off](%[sb]), %[ret]\n\t"
+        "shlq $16, %[ret]\n\t"  // drop the tag, see TAGGED_PTR
+        "shrq $16, %[ret]\n\t"
+        "jz 2f\n\t"
+        "movq %c[next_off](%[ret]), %%rcx\n\t"
+        "movq %%rcx, %c[head_off](%[sb])\n\t"
+        "2:\n\t"
+        RSEQ_ABORT_HANDLER(ret)
+        : [ret] "=&r"(ret)
+        : [cpu] "r"(cpu), [binp] "r"(binp), [sb] "r"(sbptr),
+          [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [head_off] "i"(offsetof(superblock_h_t, local_head)),
+          [next_off] "i"(offsetof(block_h_t, next))
+        : "memory", "cc", "rax", "rcx");
+    return ret;
+}
+
+/*
+ * on $cpu, pop up to $max blocks off the local head of $sbptr, if it
+ * still is the superblock in *binp, as one chain *firstp->...->*lastp;
+ * returns the number of blocks popped, or RSEQ_ABORTED if the kernel
+ * restarted us
+ */
+static inline long rseq_pop_batch(struct rseq *rs, int cpu,
+                                  superblock_h_t **binp, superblock_h_t *sbptr,
+                                  long max, block_h_t **firstp,
+                                  block_h_t **lastp)
+{
+    long ret;
+    block_h_t *first, *last;
+    __asm__ __volatile__(
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "xorq %[ret], %[ret]\n\t"
+        "cmpl %[cpu_id], %[cpu]\n\t"
+        "jnz 4f\n\t"
+        "cmpq (%[binp]), %[sb]\n\t"
+        "jnz 2f\n\t"
+        "movq %c[head_off](%[sb]), %[first]\n\t"
+        "shlq $16, %[first]\n\t"
+        "shrq $16, %[first]\n\t"
+        "jz 2f\n\t"
+        "movq %[first], %[last]\n\t"
+        "movq $1, %%rcx\n\t"
+        "5:\n\t"  // walk until max blocks or the end of the list
+        "movq %c[next_off](%[last]), %%rax\n\t"
+        "cmpq %[max], %%rcx\n\t"
+        "jge 6f\n\t"
+        "testq %%rax, %%rax\n\t"
+        "jz 6f\n\t"
+        "movq %%rax, %[last]\n\t"
+        "incq %%rcx\n\t"
+        "jmp 5b\n\t"
+        "6:\n\t"
+        "movq %%rcx, %[ret]\n\t"
+        "movq %%rax, %c[head_off](%[sb])\n\t"
+        "2:\n\t"
+        RSEQ_ABORT_HANDLER(ret)
+        : [ret] "=&r"(ret), [first] "=&r"(first), [last] "=&r"(last)
+        : [cpu] "r"(cpu), [binp] "r"(binp), [sb] "r"(sbptr), [max] "r"(max),
+          [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [head_off] "i"(offsetof(superblock_h_t, local_head)),
+          [next_off] "i"(offsetof(block_h_t, next))
+        : "memory", "cc", "rax", "rcx");
+    *firstp = first;
+    *lastp = last;
+    return ret;
+}
+
+/*
+ * on $cpu, push the chain first->...->last to the local head of $mama_s
+ * if it is the superblock in *binp; returns 1 if pushed, 0 if mama_s
+ * is not local, or RSEQ_ABORTED if the kernel restarted us
+ */
+static inline long rseq_push(struct rseq *rs, int cpu, superblock_h_t **binp,
+                             superblock_h_t *mama_s, block_h_t *first,
+                             block_h_t *last)
+{
+    long ret;
+    __asm__ __volatile__(
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "xorq %[ret], %[ret]\n\t"
+        "cmpl %[cpu_id], %[cpu]\n\t"
+        "jnz 4f\n\t"
+        "cmpq (%[binp]), %[mama]\n\t"
+        "jnz 2f\n\t"
+        "movq %c[head_off](%[mama]), %%rcx\n\t"
+        "shlq $16, %%rcx\n\t"
+        "shrq $16, %%rcx\n\t"
+        "movq %%rcx, %c[next_off](%[last])\n\t"
+        "movq $1, %[ret]\n\t"
+        "movq %[first], %c[head_off](%[mama])\n\t"
+        "2:\n\t"
+        RSEQ_ABORT_HANDLER(ret)
+        : [ret] "=&r"(ret)
+        : [cpu] "r"(cpu), [binp] "r"(binp), [mama] "r"(mama_s),
+          [first] "r"(first), [last] "r"(last),
+          [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs),
+          [head_off] "i"(offsetof(superblock_h_t, local_head)),
+          [next_off] "i"(offsetof(block_h_t, next))
+        : "memory", "cc", "rax", "rcx");
+    return ret;
+}
+
+/*
+ * on $cpu, replace *binp with $newv if it still holds $expect;
+ * returns 1 if replaced, 0 if *binp changed, or RSEQ_ABORTED
+ */
+static inline long rseq_cmpxchg(struct rseq *rs, int cpu, superblock_h_t **binp,
+                                superblock_h_t *expect, superblock_h_t *newv)
+{
+    long ret;
+    __asm__ __volatile__(
+        RSEQ_CS_DESCRIPTOR
+        "1:\n\t"
+        "xorq %[ret], %[ret]\n\t"
+        "cmpl %[cpu_id], %[cpu]\n\t"
+        "jnz 4f\n\t"
+        "cmpq (%[binp]), %[expect]\n\t"
+        "jnz 2f\n\t"
+        "movq $1, %[ret]\n\t"
+        "movq %[newv], (%[binp])\n\t"
+        "2:\n\t"
+        RSEQ_ABORT_HANDLER(ret)
+        : [ret] "=&r"(ret)
+        : [cpu] "r"(cpu), [binp] "r"(binp), [expect] "r"(expect),
+          [newv] "r"(newv),
+          [cpu_id] "m"(rs->cpu_id), [rseq_cs] "m"(rs->rseq_cs)
+        : "memory", "cc", "rax");
+    return ret;
+}
+
+/*
+ * rseq flavour of restartable_critical_section:
+ * pops a block off the current CPU's superblock, retrying on abort; the
+ * block is counted in before the pop commits, see destory_superblock();
+ * returns NULL if the slow path should be taken
+ */
+block_h_t *rseq_critical_section(int sc)
+{
+    struct rseq *rs = rseq_area();
+    superblock_h_t *sbptr;
+    long ret;
+    int cpu;
+    do {
+        cpu = rs->cpu_id_start;
+        sbptr = __atomic_load_n(&cpu_heaps[cpu].bins[sc], __ATOMIC_RELAXED);
+        if (sbptr == NULL || !reserve_blocks(sbptr, 1)) {
+            ret = 0;
+            break;
+        }
+        ret = rseq_pop(rs, cpu, &cpu_heaps[cpu].bins[sc], sbptr);
+        if (ret == 0 || ret == RSEQ_ABORTED) unreserve_blocks(sbptr, 1);
+        if (ret == RSEQ_ABORTED) TELEM_RECORD(TELEM_RESTART, telemetry_since);
+    } while (ret == RSEQ_ABORTED);
+
+    my_cpu = cpu;
+    return (block_h_t *)ret;
+}
+
+/*
+ * rseq flavour of restartable_critical_section_batch:
+ * pops up to $max blocks off the current CPU's superblock in one go,
+ * counting all $max in first and giving back what it did not get;
+ * returns the number of blocks, NULL terminated at *firstp
+ */
+int rseq_critical_section_batch(int sc, int max, block_h_t **firstp)
+{
+    struct rseq *rs = rseq_area();
+    superblock_h_t *sbptr;
+    block_h_t *last;
+    long ret;
+    int cpu;
+    do {
+        cpu = rs->cpu_id_start;
+        sbptr = __atomic_load_n(&cpu_heaps[cpu].bins[sc], __ATOMIC_RELAXED);
+        if (sbptr == NULL || !reserve_blocks(sbptr, max)) {
+            ret = 0;
+            break;
+        }
+        ret = rseq_pop_batch(rs, cpu, &cpu_heaps[cpu].bins[sc], sbptr, max,
+                             firstp, &last);
+        unreserve_blocks(sbptr, ret == RSEQ_ABORTED ? max : max - (int)ret);
+        if (ret == RSEQ_ABORTED) TELEM_RECORD(TELEM_RESTART, telemetry_since);
+    } while (ret == RSEQ_ABORTED);
+
+    my_cpu = cpu;
+    if (ret == 0) return 0;
+    last->next = NULL;
+    return (int)ret;
+}
+
+/*
+ * rseq flavour of restartable_critical_section_free:
+ * returns 0 if slow path is taken;
+ * returns 1 if fast path is taken;
+ */
+int rseq_critical_section_free(superblock_h_t *mama_s, block_h_t *first,
+                               block_h_t *last, int count)
+{
+    struct rseq *rs = rseq_area();
+    size_t sc = mama_s->size_class;
+    long ret;
+    int cpu;
+    do {
+        cpu = rs->cpu_id_start;
+        ret = rseq_push(rs, cpu, &cpu_heaps[cpu].bins[sc], mama_s, first,
+                        last);
+        if (ret == RSEQ_ABORTED) TELEM_RECORD(TELEM_RESTART, telemetry_since);
+    } while (ret == RSEQ_ABORTED);
+
+    my_cpu = cpu;
+    if (ret == 0) return 0;
+    __atomic_fetch_sub(&mama_s->in_use_count, count, __ATOMIC_RELAXED);
+    return 1;
+}
+
+/*
+ * install $new_sbptr as $cpu's superblock for $sc if $old_sbptr is still
+ * there; fails if another thread swapped it first or we left $cpu
+ */
+int rseq_install_superblock(int cpu, int sc, superblock_h_t *old_sbptr,
+                            superblock_h_t *new_sbptr)
+{
+    struct rseq *rs = rseq_area();
+    long ret;
+    do {
+        ret = rseq_cmpxchg(rs, cpu, &cpu_heaps[cpu].bins[sc], old_sbptr,
+                           new_sbptr);
+        if (ret == RSEQ_ABORTED && (int)rs->cpu_id_start != cpu) return 0;
+    } while (ret == RSEQ_ABORTED);
+    return (int)ret;
+}
@@ -0,0 +1,467 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <sys/mman.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Page heap for medium sized blocks (TCMalloc PageHeap style).
+ *
+ * A medium block is one span of whole SPAN_PAGE_SIZE pages, carved from
+ * the span half of the arena. Free spans of up to SPAN_MAX_PAGES pages sit
+ * on one list per length, longer ones on a single list; allocation takes
+ * the shortest free span that fits (best fit) and splits off the rest.
+ * The page map maps the first and the last page of every span to its
+ * span_t, so a freed span finds its neighbours in O(1) and merges with
+ * the free ones. All of it is guarded by span_lock.
+ *
+ * In huge page mode the span half grows by whole huge pages, and
+ * span_trim() only releases the huge pages a free span covers entirely:
+ * releasing part of one would split it back into small pages.
+ */
+
+static span_t *span_lists[SPAN_MAX_PAGES + 1];  // index: pages
+static span_t *span_large = NULL;               // > SPAN_MAX_PAGES pages
+static uint64_t span_nonempty[SPAN_MAX_PAGES / 64 + 1];
+static span_t *span_meta_free = NULL;  // recycled span_t
+static size_t span_used_pages = 0;     // pages of the spans in use
+static size_t span_free_pages = 0;     // pages of the free spans
+static size_t span_free_count = 0;     // number of free spans
+static pthread_mutex_t span_lock = PTHREAD_MUTEX_INITIALIZER;
+
+#define SPAN_END(s) ((s)->start + ((s)->pages << SPAN_PAGE_SHIFT))
+
+/*
+ * pages of the span serving $size bytes
+ */
+size_t span_pages(size_t size)
+{
+    return (size + SPAN_PAGE_SIZE - 1) >> SPAN_PAGE_SHIFT;
+}
+
+/*
+ * get a span_t, mmapping a new batch of them when none is left
+ */
+static span_t *span_meta_new()
+{
+    if (span_meta_free == NULL) {
+        span_t *batch = mmap(NULL, SB_SIZE, PROT_READ | PROT_WRITE,
+                             MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (batch == MAP_FAILED) return NULL;
+        size_t i, n = SB_SIZE / sizeof(span_t);
+        for (i = 0; i < n; i++) {
+            batch[i].next = span_meta_free;
+            span_meta_free = &batch[i];
+        }
+    }
+    span_t *span = span_meta_free;
+    span_meta_free = span->next;
+    return span;
+}
+
+static void span_meta_delete(span_t *span)
+{
+    span->next = span_meta_free;
+    span_meta_free = span;
+}
+
+/*
+ * the free list holding spans of $pages pages
+ */
+static span_t **span_list_of(size_t pages)
+{
+    return pages <= SPAN_MAX_PAGES ? &span_lists[pages] : &span_large;
+}
+
+static void span_list_insert(span_t *span)
+{
+    span_t **list = span_list_of(span->pages);
+    span->prev = NULL;
+    span->next = *list;
+    if (span->next != NULL) span->next->prev = span;
+    *list = span;
+    span->free = 1;
+    span_free_pages += span->pages;
+    span_free_count++;
+    if (span->pages <= SPAN_MAX_PAGES)
+        span_nonempty[span->pages / 64] |= (uint64_t)1 << (span->pages % 64);
+}
+
+static void span_list_remove(span_t *span)
+{
+    span_t **list = span_list_of(span->pages);
+    if (span->prev != NULL)
+        span->prev->next = span->next;
+    else
+        *list = span->next;
+    if (span->next != NULL) span->next->prev = span->prev;
+    span->free = 0;
+    span_free_pages -= span->pages;
+    span_free_count--;
+    if (span->pages <= SPAN_MAX_PAGES && *list == NULL)
+        span_nonempty[span->pages / 64] &=
+            ~((uint64_t)1 << (span->pages % 64));
+}
+
+/*
+ * map the first and the last page of span to it
+ */
+static int span_register(span_t *span)
+{
+    if (pagemap_set(span->start, 1, span) != SUCCESS) return FAILURE;
+    return pagemap_set(SPAN_END(span) - 1, 1, span);
+}
+
+/*
+ * shortest free span of at least $pages pages, NULL if none
+ */
+static span_t *span_best_fit(size_t pages)
+{
+    size_t i;
+    for (i = pages; i <= SPAN_MAX_PAGES; i++) {
+        uint64_t bits = span_nonempty[i / 64] >> (i % 64);
+        if (bits == 0) {
+            i = (i | 63);  // skip the rest of this word
+            continue;
+        }
+        i += __builtin_ctzll(bits);
+        if (i <= SPAN_MAX_PAGES) return span_lists[i];
+    }
+    span_t *best = NULL, *itr;
+    for (itr = span_large; itr != NULL; itr = itr->next) {
+        if (itr->pages >= pages && (best == NULL || itr->pages < best->pages))
+            best = itr;
+    }
+    return best;
+}
+
+/*
+ * a span merged with free neighbour $part is as old as the older of the
+ * two, else steady frees next to a free span would keep it from decaying
+ */
+static void span_merge_age(span_t *span, span_t *part)
+{
+    if (!part->clean && part->free_since < span->free_since)
+        span->free_since = part->free_since;
+}
+
+/*
+ * put span on its free list, merged with its free neighbours
+ */
+static void span_release(span_t *span)
+{
+    span_t *left = NULL, *right = NULL;
+    span->free_since = purge_clock_ms();
+    if (span->start > (char *)span_region_lo)
+        left = pagemap_get(span->start - 1);
+    if (SPAN_END(span) < (char *)span_region_hi)
+        right = pagemap_get(SPAN_END(span));
+
+    if (left != NULL && left->free && SPAN_END(left) == span->start) {
+        span_list_remove(left);
+        span->start = left->start;
+        span->pages += left->pages;
+        span_merge_age(span, left);
+        span_meta_delete(left);
+    }
+    if (right != NULL && right->free && SPAN_END(span) == right->start) {
+        span_list_remove(right);
+        span->pages += right->pages;
+        span_merge_age(span, right);
+        span_meta_delete(right);
+    }
+    // freed pages are dirty, and so is anything merged with them
+    span->clean = 0;
+    span->size_class = 0;
+    span_register(span);
+    span_list_insert(span);
+}
+
+/*
+ * add at least $pages fresh pages of the arena to the free lists;
+ * returns FAILURE once the arena is used up
+ */
+static int span_grow(size_t pages)
+{
+    if (pages < SPAN_GROW_PAGES) pages = SPAN_GROW_PAGES;
+    span_t *span = span_meta_new();
+    if (span == NULL) return FAILURE;
+    size_t len = pages << SPAN_PAGE_SHIFT;
+    span->start = arena_grow_spans(&len);
+    if (span->start == NULL) {
+        span_meta_delete(span);
+        return FAILURE;
+    }
+    span->pages = len >> SPAN_PAGE_SHIFT;
+    span->size_class = 0;
+    span->clean = 1;
+    span->free_since = 0;
+    span_register(span);
+    span_list_insert(span);
+    return SUCCESS;
+}
+
+/*
+ * take the best fitting free span of at least $pages pages off its
+ * list, growing the heap if there is none; NULL if out of memory;
+ * span_lock must be held
+ */
+static span_t *span_take(size_t pages)
+{
+    span_t *span = span_best_fit(pages);
+    if (span == NULL) {
+        if (span_grow(pages) != SUCCESS) return NULL;
+        span = span_best_fit(pages);
+    }
+    span_list_remove(span);
+    return span;
+}
+
+/*
+ * cut a taken span down to $pages pages, what is left stays free;
+ * span_lock must be held
+ */
+static void span_carve(span_t *span, size_t pages)
+{
+    if (span->pages > pages) {
+        span_t *rest = span_meta_new();
+        if (rest != NULL) {
+            rest->start = span->start + (pages << SPAN_PAGE_SHIFT);
+            rest->pages = span->pages - pages;
+            rest->size_class = 0;
+            rest->clean = span->clean;
+            rest->free_since = span->free_since;
+            span->pages = pages;
+            span_register(rest);
+            span_list_insert(rest);
+            // its first page is mapped already, its last one moved
+            pagemap_set(SPAN_END(span) - 1, 1, span);
+        }
+    }
+}
+
+/*
+ * allocate a span of $pages pages for size class $sc (0 if none), zeroed
+ * if $zero is set and it has been written to since it left the OS;
+ * returns its first byte, NULL if out of memory
+ */
+void *span_malloc(size_t pages, int sc, int zero)
+{
+    pthread_mutex_lock(&span_lock);
+    span_t *span = span_take(pages);
+    if (span == NULL) {
+        pthread_mutex_unlock(&span_lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+    span_carve(span, pages);
+    span->size_class = sc;
+    span_used_pages += span->pages;
+    STATS_COUNT(allocs, sc);
+    int dirty = !span->clean;
+    span->clean = 0;
+    pthread_mutex_unlock(&span_lock);
+    if (zero && dirty) zero_block(span->start, span->pages << SPAN_PAGE_SHIFT);
+    return span->start;
+}
+
+/*
+ * allocate a span of $pages pages starting on an $align boundary, a
+ * power of two above SPAN_PAGE_SIZE; the pages in front of the boundary
+ * stay free; returns its first byte, NULL if out of memory
+ */
+void *span_memalign(size_t pages, size_t align)
+{
+    pthread_mutex_lock(&span_lock);
+    span_t *span = span_take(pages + (align >> SPAN_PAGE_SHIFT) - 1);
+    span_t *head = span != NULL ? span_meta_new() : NULL;
+    if (head == NULL) {
+        if (span != NULL) span_list_insert(span);
+        pthread_mutex_unlock(&span_lock);
+        errno = ENOMEM;
+        return NULL;
+    }
+
+    char *start = (char *)(((uintptr_t)span->start + align - 1) &
+                           ~((uintptr_t)align - 1));
+    if (start != span->start) {
+        // the pages in front of the boundary stay free on their own
+        head->start = span->start;
+        head->pages = (start - span->start) >> SPAN_PAGE_SHIFT;
+        head->size_class = 0;
+        head->clean = span->clean;
+        head->free_since = span->free_since;
+        span->start = start;
+        span->pages -= head->pages;
+        span_register(head);
+        span_register(span);
+        span_list_insert(head);
+    } else {
+        span_meta_delete(head);
+    }
+    span_carve(span, pages);
+    span->size_class = 0;
+    span->clean = 0;
+    span_used_pages += span->pages;
+    STATS_COUNT(allocs, 0);
+    pthread_mutex_unlock(&span_lock);
+    return span->start;
+}
+
+/*
+ * the span in use starting at $ptr, NULL if there is none
+ */
+span_t *span_of(void *ptr)
+{
+    if (ptr < span_region_lo || ptr >= span_region_hi) return NULL;
+    span_t *span = pagemap_get(ptr);
+    if (span == NULL || span->start != ptr || span->free) return NULL;
+    return span;
+}
+
+/*
+ * give a span in use back to the page heap, then see if free spans are
+ * due for purging: a program that frees no small blocks ticks here
+ */
+void span_free(span_t *span)
+{
+    pthread_mutex_lock(&span_lock);
+    span_used_pages -= span->pages;
+    STATS_COUNT(frees, span->size_class);
+    span_release(span);
+    pthread_mutex_unlock(&span_lock);
+    purge_tick();
+}
+
+/*
+ * resize a span in use to $pages pages without moving it: shrinking
+ * gives its tail back, growing takes the head of its free right
+ * neighbour; returns FAILURE if that neighbour is too short
+ */
+int span_resize(span_t *span, size_t pages)
+{
+    pthread_mutex_lock(&span_lock);
+    size_t old_pages = span->pages;
+    if (pages > span->pages) {
+        size_t more = pages - span->pages;
+        span_t *right = NULL;
+        if (SPAN_END(span) < (char *)span_region_hi)
+            right = pagemap_get(SPAN_END(span));
+        if (right == NULL || !right->free || right->start != SPAN_END(span) ||
+            right->pages < more) {
+            pthread_mutex_unlock(&span_lock);
+            return FAILURE;
+        }
+        span_list_remove(right);
+        if (right->pages == more) {
+            span_meta_delete(right);
+        } else {
+            right->start += more << SPAN_PAGE_SHIFT;
+            right->pages -= more;
+            span_register(right);
+            span_list_insert(right);
+        }
+        span->pages = pages;
+        pagemap_set(SPAN_END(span) - 1, 1, span);
+    } else if (pages < span->pages) {
+        span_t *rest = span_meta_new();
+        if (rest != NULL) {
+            rest->start = span->start + (pages << SPAN_PAGE_SHIFT);
+            rest->pages = span->pages - pages;
+            rest->free = 0;
+            span->pages = pages;
+            pagemap_set(SPAN_END(span) - 1, 1, span);
+            span_release(rest);
+        }
+    }
+    // no longer the size of its span class, if it had one
+    if (span->size_class != 0) {
+        STATS_COUNT(frees, span->size_class);
+        STATS_COUNT(allocs, 0);
+        span->size_class = 0;
+    }
+    span_used_pages += span->pages - old_pages;
+    pthread_mutex_unlock(&span_lock);
+    return SUCCESS;
+}
+
+/*
+ * bytes in spans in use and in free spans, and the number of free spans
+ */
+void span_stats(size_t *in_use, size_t *free_bytes, size_t *free_spans)
+{
+    pthread_mutex_lock(&span_lock);
+    *in_use = span_used_pages << SPAN_PAGE_SHIFT;
+    *free_bytes = span_free_pages << SPAN_PAGE_SHIFT;
+    *free_spans = span_free_count;
+    pthread_mutex_unlock(&span_lock);
+}
+
+/*
+ * hand the pages of a dirty free span back to the OS, only the huge
+ * pages it covers entirely in huge page mode; returns the bytes released
+ */
+static size_t span_purge(span_t *span)
+{
+    char *lo = span->start, *hi = SPAN_END(span);
+    if (arena_thp != THP_OFF) {
+        lo = (char *)(((uintptr_t)lo + HUGE_PAGE_SIZE - 1) &
+                      ~(HUGE_PAGE_SIZE - 1));
+        hi = (char *)((uintptr_t)hi & ~(HUGE_PAGE_SIZE - 1));
+        if (hi <= lo) return 0;
+    }
+    if (madvise(lo, hi - lo, MADV_DONTNEED) != 0) return 0;
+    // ends sharing a huge page with spans in use stay dirty
+    if (lo == span->start && hi == SPAN_END(span)) span->clean = 1;
+    return hi - lo;
+}
+
+/*
+ * hand the pages of every dirty free span that has been free for
+ * $decay_ms at least back to the OS; span_lock must be held;
+ * returns the number of bytes released
+ */
+static size_t span_purge_free(uint64_t decay_ms)
+{
+    uint64_t now = purge_clock_ms();
+    size_t released = 0;
+    size_t i;
+    for (i = 1; i <= SPAN_MAX_PAGES + 1; i++) {
+        span_t *itr = i <= SPAN_MAX_PAGES ? span_lists[i] : span_large;
+        for (; itr != NULL; itr = itr->next) {
+            if (itr->clean || now - itr->free_since < decay_ms) continue;
+            released += span_purge(itr);
+        }
+    }
+    return released;
+}
+
+/*
+ * hand the pages of every dirty free span back to the OS;
+ * returns the number of bytes released
+ */
+size_t span_trim()
+{
+    pthread_mutex_lock(&span_lock);
+    size_t released = span_purge_free(0);
+    pthread_mutex_unlock(&span_lock);
+    return released;
+}
+
+/*
+ * called from purge_tick(): release the free spans whose decay ran out,
+ * unless the page heap is busy; returns the number of bytes released
+ */
+size_t span_decay(uint64_t decay_ms)
+{
+    if (pthread_mutex_trylock(&span_lock) != 0) return 0;
+    size_t released = span_purge_free(decay_ms);
+    pthread_mutex_unlock(&span_lock);
+    return released;
+}
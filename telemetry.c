@@ -0,0 +1,193 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#if defined(__x86_64__)
+#include <x86intrin.h>
+#endif
+#include "common.h"
+
+/*
+ * Telemetry of the critical sections.
+ *
+ * Off unless SPEEDYLOC_TELEMETRY is set, in which case every event below
+ * is counted and timed in the shard of the CPU it ran on, and the totals
+ * are printed when the process exits: to stderr for SPEEDYLOC_TELEMETRY=1,
+ * else appended to the file it names. While off, TELEM_START and
+ * TELEM_RECORD cost one predictable branch each.
+ *
+ * Cycles come from the time stamp counter, nanoseconds where there is
+ * none. Restarts are timed from the start of the malloc or free they
+ * interrupted, upcalls are only counted.
+ */
+
+int telemetry_on = 0;
+__thread uint64_t telemetry_since = 0;  // start of the operation timed last
+static const char *telemetry_path = NULL;
+static telemetry_shard_t telemetry_shards[MAX_SYS_CORE_COUNT];
+
+static const char *telemetry_names[TELEM_EVENTS] = {
+    "fast_malloc", "fast_free",   "slow_refill",  "new_superblock", "upcall",
+    "restart",     "remote_free", "remote_retry", "lock_wait",
+};
+
+/*
+ * read the telemetry setting from the environment
+ */
+int initialize_telemetry()
+{
+    char *env = getenv("SPEEDYLOC_TELEMETRY");
+    if (env == NULL || *env == '\0' || strcmp(env, "0") == 0) return SUCCESS;
+    if (strcmp(env, "1") != 0) telemetry_path = env;
+    telemetry_on = 1;
+    return SUCCESS;
+}
+
+/*
+ * cycle counter the events are timed with
+ */
+uint64_t telemetry_clock()
+{
+#if defined(__x86_64__)
+    return __rdtsc();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000000 + ts.tv_nsec;
+#endif
+}
+
+/*
+ * count one $event that started at $start cycles (0: untimed) in the
+ * shard of the CPU we last ran on; like STATS_COUNT, a stale my_cpu may
+ * lose an event but never corrupts one
+ */
+void telemetry_record(int event, uint64_t start)
+{
+    uint64_t cycles = start != 0 ? telemetry_clock() - start : 0;
+    int bucket = cycles != 0 ? 64 - __builtin_clzll(cycles) : 0;
+    if (bucket >= TELEM_BUCKETS) bucket = TELEM_BUCKETS - 1;
+
+    telemetry_t *t =
+        &telemetry_shards[my_cpu & (MAX_SYS_CORE_COUNT - 1)].events[event];
+    t->count++;
+    t->cycles += cycles;
+    t->hist[bucket]++;
+}
+
+/*
+ * lock $lock, timing the wait as TELEM_LOCK_WAIT if it was held
+ */
+void telemetry_lock(pthread_mutex_t *lock)
+{
+    if (!telemetry_on) {
+        pthread_mutex_lock(lock);
+        return;
+    }
+    if (pthread_mutex_trylock(lock) == 0) return;
+    uint64_t start = telemetry_clock();
+    pthread_mutex_lock(lock);
+    telemetry_record(TELEM_LOCK_WAIT, start);
+}
+
+/*
+ * query API: sum the shards of $event into *out;
+ * returns FAILURE for an unknown event
+ */
+int speedyloc_telemetry(int event, telemetry_t *out)
+{
+    if (event < 0 || event >= TELEM_EVENTS) return FAILURE;
+    memset(out, 0, sizeof(*out));
+    int cpu, b;
+    for (cpu = 0; cpu < MAX_SYS_CORE_COUNT; cpu++) {
+        telemetry_t *t = &telemetry_shards[cpu].events[event];
+        out->count += __atomic_load_n(&t->count, __ATOMIC_RELAXED);
+        out->cycles += __atomic_load_n(&t->cycles, __ATOMIC_RELAXED);
+        for (b = 0; b < TELEM_BUCKETS; b++)
+            out->hist[b] += __atomic_load_n(&t->hist[b], __ATOMIC_RELAXED);
+    }
+    return SUCCESS;
+}
+
+/*
+ * name of $event, NULL for an unknown one
+ */
+const char *speedyloc_telemetry_name(int event)
+{
+    if (event < 0 || event >= TELEM_EVENTS) return NULL;
+    return telemetry_names[event];
+}
+
+/*
+ * upper bound, in cycles, of the bucket the $pct-th percentile of $t
+ * falls in
+ */
+static uint64_t telemetry_percentile(telemetry_t *t, int pct)
+{
+    uint64_t seen = 0, rank = (t->count * pct + 99) / 100;
+    int b;
+    for (b = 0; b < TELEM_BUCKETS; b++) {
+        seen += t->hist[b];
+        if (seen >= rank) break;
+    }
+    return b == 0 ? 0 : (uint64_t)1 << b;
+}
+
+/*
+ * print every event seen, with its cycle histogram, to $fd
+ */
+void speedyloc_telemetry_dump(int fd)
+{
+    static const char *engines[] = {"signal", "rseq", "cas"};
+    dprintf(fd, "speedyloc telemetry: pid %d, engine %s, %s\n", getpid(),
+            engines[malloc_engine],
+#if defined(__x86_64__)
+            "cycles from rdtsc"
+#else
+            "cycles in ns"
+#endif
+    );
+    dprintf(fd, "%-15s %14s %12s %10s %10s\n", "event", "count",
+            "avg cycles", "p50 <=", "p99 <=");
+
+    int event, b;
+    for (event = 0; event < TELEM_EVENTS; event++) {
+        telemetry_t t;
+        speedyloc_telemetry(event, &t);
+        if (t.count == 0) continue;
+        dprintf(fd, "%-15s %14lu %12lu %10lu %10lu\n", telemetry_names[event],
+                t.count, t.cycles / t.count, telemetry_percentile(&t, 50),
+                telemetry_percentile(&t, 99));
+        if (t.cycles == 0) continue;  // counted only
+        // bucket b holds [2^(b-1), 2^b) cycles
+        dprintf(fd, "  hist");
+        for (b = 0; b < TELEM_BUCKETS; b++)
+            if (t.hist[b] != 0) dprintf(fd, " <2^%d:%lu", b, t.hist[b]);
+        dprintf(fd, "\n");
+    }
+}
+
+/*
+ * dump the telemetry when the process exits, if asked for
+ */
+__attribute__((destructor)) static void telemetry_at_exit()
+{
+    if (!telemetry_on) return;
+    if (telemetry_path == NULL) {
+        speedyloc_telemetry_dump(STDERR_FILENO);
+        return;
+    }
+    int fd = open(telemetry_path, O_WRONLY | O_CREAT | O_APPEND, 0644);
+    if (fd < 0) return;
+    speedyloc_telemetry_dump(fd);
+    close(fd);
+}
@@ -0,0 +1,140 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <setjmp.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <unistd.h>
+#include "common.h"
+
+/*
+ * Per thread cache in front of the per-CPU heaps (TCMalloc style).
+ *
+ * Each thread keeps a bounded free list per size class that is served
+ * with plain loads and stores: no atomics, no setjmp, no critical
+ * section. Blocks move between the cache and the CPU heap in batches of
+ * size_to_no_blocks() blocks, one critical section per batch. When a
+ * thread exits, the pthread key destructor hands its blocks back.
+ */
+
+__thread thread_cache_t tcache;
+pthread_key_t tcache_key;
+
+/*
+ * create the key whose destructor drains a cache at thread exit
+ */
+int initialize_thread_cache()
+{
+    if (pthread_key_create(&tcache_key, thread_cache_destroy) != 0)
+        return FAILURE;
+    return SUCCESS;
+}
+
+/*
+ * most blocks a thread keeps for $sc before flushing
+ */
+static inline int thread_cache_limit(int sc)
+{
+    return 2 * size_to_no_blocks(class_to_size_[sc]);
+}
+
+/*
+ * give the first $count cached blocks of $sc back to their superblocks,
+ * one chain per run of blocks born in the same superblock
+ */
+void thread_cache_flush(int sc, int count)
+{
+    block_h_t *first = tcache.heads[sc];
+    while (first != NULL && count > 0) {
+        superblock_h_t *mama_s = SUPERBLOCK_OF(first);
+        block_h_t *last = first;
+        int run = 1;
+        while (run < count && last->next != NULL &&
+               SUPERBLOCK_OF(last->next) == mama_s) {
+            last = last->next;
+            run++;
+        }
+        block_h_t *rest = last->next;
+        tcache.heads[sc] = rest;
+        tcache.counts[sc] -= run;
+        count -= run;
+        release_blocks(mama_s, first, last, run);
+        first = rest;
+    }
+}
+
+/*
+ * pthread key destructor: drain every size class of the exiting thread;
+ * later allocations of this thread skip the cache
+ */
+void thread_cache_destroy(void *arg)
+{
+    int sc;
+    tcache.state = TCACHE_DEAD;
+    for (sc = 1; sc < num_size_classes; sc++) {
+        thread_cache_flush(sc, tcache.counts[sc]);
+    }
+}
+
+/*
+ * register the destructor the first time a thread uses its cache;
+ * returns 0 if the cache must not be used
+ */
+static inline int thread_cache_live()
+{
+    if (tcache.state == TCACHE_LIVE) return 1;
+    if (tcache.state == TCACHE_DEAD) return 0;
+    // any non-NULL value makes the destructor run
+    if (pthread_setspecific(tcache_key, &tcache) != 0) return 0;
+    tcache.state = TCACHE_LIVE;
+    return 1;
+}
+
+/*
+ * pop a cached block of $sc; refill the cache with one batch from the
+ * CPU heap when it is empty
+ */
+void *thread_cache_malloc(int sc)
+{
+    if (!thread_cache_live()) return search_local_block(sc);
+
+    block_h_t *bptr = tcache.heads[sc];
+    if (bptr != NULL) {
+        tcache.heads[sc] = bptr->next;
+        tcache.counts[sc]--;
+        return bptr;
+    }
+
+    // FAST PATH: one critical section for a whole batch
+    TELEM_START();  // restarts are timed from here
+    if (malloc_engine == ENGINE_SIGNAL) setjmp(critical_section_malloc);
+    int count = restartable_critical_section_batch(
+        sc, size_to_no_blocks(class_to_size_[sc]), &bptr);
+    if (count == 0) {
+        // SLOW PATH: let the CPU heap refill itself, one block this time
+        return search_local_block(sc);
+    }
+    tcache.heads[sc] = bptr->next;
+    tcache.counts[sc] = count - 1;
+    return bptr;
+}
+
+/*
+ * cache a freed block of mama_s; flush a batch when over the limit;
+ * returns 0 if the block was not taken
+ */
+int thread_cache_free(superblock_h_t *mama_s, block_h_t *bptr)
+{
+    if (!thread_cache_live()) return 0;
+
+    int sc = mama_s->size_class;
+    bptr->next = tcache.heads[sc];
+    tcache.heads[sc] = bptr;
+    if (++tcache.counts[sc] > thread_cache_limit(sc)) {
+        thread_cache_flush(sc, size_to_no_blocks(class_to_size_[sc]));
+    }
+    return 1;
+}